@@ -0,0 +1,428 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <utility>
+#include <sys/stat.h>
+#include "Types.h"
+#include "BlockAverager.h"
+#include "inipp.h"
+#include "IniHelpers.h"
+
+// W replicas of one VERLET config advanced in lockstep, meant for small N where a single
+// pair loop is too short to vectorise. Every per-particle value is stored as W consecutive
+// lanes (particle i, replica l at i * W + l), so the innermost loops run across replicas and
+// compile to SIMD. Replicas differ only in their seed, each lane has its own dt.
+// Same physics as VerletSimulator on the CPU minus collision counting; escaped particles are
+// frozen in place instead of being compacted away.
+// Stats per lane are E, T, pvirial, Time, In box, E drift, Force evals and the averagedStats
+// means and errors. pFlux, the Hits and the sampled observables (g(r), D, clusters) aren't
+// measured here.
+template<typename real, int W>
+class BatchedVerlet
+{
+	int N = 0;
+	real Lx = 1, Ly = 1;
+	real sigma = 1, epsilon = 4;
+	real ATSPathThreshold = real(0.00015);
+	real explosionProtectionThreshold = 50;
+	real cutoffRadius = 0;
+	real initPoxScale = real(0.5);
+	int nAvg = 4;
+	int bUseAdaptiveTimeStep = true;
+	int edgeCondition = 0;
+
+	std::vector<real> px, py, vx, vy, ax, ay;
+	real dt[W], dt2[W];
+	// Sums over particles and steps are double whatever real is, the pair math stays in real
+	double ke[W], pe[W], virial[W], _time[W];
+	int numInBox[W];
+	std::vector<std::map<std::string, real>> stats;
+	// E of the first update per lane, the drift is measured against it
+	double initialEnergy[W];
+	bool bHaveInitialEnergy = false;
+	long long forceEvaluations = 0;
+	// Block averages of the averagedStats names, per lane, the same as VerletSimulator::UpdateAverages()
+	std::vector<std::string> averagedNames;
+	std::vector<BlockAverager> averages;
+	int averageWarmup = 0;
+	int updatesDone = 0;
+
+	bool WrapsX() const
+	{
+		switch (edgeCondition)
+		{ case 2: case 3: case 4: case 6: return false; }
+		return true;
+	}
+	bool WrapsY() const
+	{
+		switch (edgeCondition)
+		{ case 1: case 2: case 3: case 6: return false; }
+		return true;
+	}
+	bool CompactsEscaped() const
+	{
+		switch (edgeCondition)
+		{ case 3: case 4: case 5: return true; }
+		return false;
+	}
+
+	// Same lattice in every lane, velocities drawn in the order VerletSimulator::InitPosCPU uses
+	void InitPos(int nRow, real vMax, const unsigned int* seeds)
+	{
+		std::uniform_real_distribution<real> random(real(-1.0), real(1.0));
+		int nCol = N / nRow + ((N % nRow == 0) ? 0 : 1);
+		real ay0 = Ly / nRow;
+		real ax0 = Lx / nRow;
+		for (int l = 0; l < W; ++l)
+		{
+			std::mt19937 rng(seeds[l]);
+			int i = 0;
+			for (int ix = 0; ix < nCol && i < N; ++ix)
+				for (int iy = 0; iy < nRow && i < N; ++iy, ++i)
+				{
+					py[i * W + l] = ay0 * (iy + real(0.5)) * initPoxScale;
+					px[i * W + l] = ax0 * (ix + real(0.5)) * initPoxScale;
+					vx[i * W + l] = random(rng) * vMax;
+					vy[i * W + l] = random(rng) * vMax;
+				}
+		}
+	}
+
+	// Boundary handling of the Transport_* functions in VerletSimulator, written with selects
+	// so the lane loop stays branch-free. Edge is a constant, the other modes fold away.
+	template<int Edge>
+	__forceinline void Transport(real& x, real& y, real& u, real& v) const
+	{
+		const real hole0 = real(0.25) * Ly, hole1 = real(0.75) * Ly;
+		const real wall = Lx * real(1.05), outer = Lx * real(1.1);
+		if (Edge == 0 || Edge == 1 || Edge == 5)
+			x = x < 0 ? x + Lx : x;
+		if (Edge == 0 || Edge == 1)
+			x = x > Lx ? x - Lx : x;
+		if (Edge == 2)
+			u = x < 0 ? std::abs(u) : (x > Lx ? -std::abs(u) : u);
+		if (Edge == 3 || Edge == 4)
+		{
+			const bool bInHole = y > hole0 && y < hole1;
+			u = x < 0 ? std::abs(u) : u;
+			u = (x > Lx && x < wall && !bInHole) ? -std::abs(u) : u;
+			u = (x >= wall && x < outer) ? std::abs(u) : u;
+		}
+		if (Edge == 5)
+		{
+			const bool bInHole = y > hole0 && y < hole1;
+			const bool bThrough = x > Lx && x < wall && !bInHole;
+			u = (x >= wall && x < outer) ? std::abs(u) : u;
+			x = bThrough ? x - Lx : x;
+		}
+		if (Edge == 6)
+		{
+			const real boxWindow = 0.5;
+			const real forcedXSpeed = 10.0;
+			const real distancePenalty = 1.5;
+			const bool bInWindow = y > real(0.5) * (real(1.0) - boxWindow) * Ly && y < real(0.5) * (real(1.0) + boxWindow) * Ly;
+			u = x < 0 ? (std::max)(std::abs(u), forcedXSpeed) : u;
+			const bool bOut = x > Lx;
+			u = (bOut && !bInWindow) ? -std::abs(u) : u;
+			y = (bOut && bInWindow) ? (y - real(0.5) * Ly) / boxWindow + real(0.5) * Ly : y;
+			x = (bOut && bInWindow) ? x - Lx * distancePenalty : x;
+		}
+
+		if (Edge == 0 || Edge == 4 || Edge == 5)
+		{
+			y = y < 0 ? y + Ly : y;
+			y = y > Ly ? y - Ly : y;
+		}
+		if (Edge == 1 || Edge == 2 || Edge == 3 || Edge == 6)
+			v = y < 0 ? std::abs(v) : (y > Ly ? -std::abs(v) : v);
+	}
+	template<int Edge>
+	void Drift()
+	{
+		const real escapeX = CompactsEscaped() ? Lx * real(1.05) : (std::numeric_limits<real>::max)();
+		for (int i = 0; i < N; ++i)
+		{
+			real* __restrict x = &px[i * W];
+			real* __restrict y = &py[i * W];
+			real* __restrict u = &vx[i * W];
+			real* __restrict v = &vy[i * W];
+			const real* __restrict ux = &ax[i * W];
+			const real* __restrict uy = &ay[i * W];
+			for (int l = 0; l < W; ++l)
+			{
+				real newX = x[l] + u[l] * dt[l] + real(0.5) * ux[l] * dt2[l];
+				real newY = y[l] + v[l] * dt[l] + real(0.5) * uy[l] * dt2[l];
+				real newU = u[l] + real(0.5) * ux[l] * dt[l];
+				real newV = v[l] + real(0.5) * uy[l] * dt[l];
+				Transport<Edge>(newX, newY, newU, newV);
+				// Escaped particles stay where they left, like the compacted tail of VerletSimulator
+				const bool bActive = x[l] < escapeX;
+				x[l] = bActive ? newX : x[l];
+				y[l] = bActive ? newY : y[l];
+				u[l] = bActive ? newU : u[l];
+				v[l] = bActive ? newV : v[l];
+			}
+		}
+	}
+	void Drift()
+	{
+		switch (edgeCondition)
+		{
+		case 0: Drift<0>(); break;
+		case 1: Drift<1>(); break;
+		case 2: Drift<2>(); break;
+		case 3: Drift<3>(); break;
+		case 4: Drift<4>(); break;
+		case 5: Drift<5>(); break;
+		case 6: Drift<6>(); break;
+		}
+	}
+
+	// All pairs, the particle i side is accumulated in registers across j
+	void Accel(double* peOut)
+	{
+		const real rc = cutoffRadius * sigma;
+		const real rc2 = rc > 0 ? rc * rc : (std::numeric_limits<real>::max)();
+		const real sigma2 = sigma * sigma;
+		const real halfX = WrapsX() ? real(0.5) * Lx : (std::numeric_limits<real>::max)();
+		const real halfY = WrapsY() ? real(0.5) * Ly : (std::numeric_limits<real>::max)();
+
+		std::fill(ax.begin(), ax.end(), real(0));
+		std::fill(ay.begin(), ay.end(), real(0));
+		// A row of pairs is summed in real, the rows in double
+		double peLane[W] = {};
+		for (int i = 0; i < N; ++i)
+		{
+			const real* __restrict xi = &px[i * W];
+			const real* __restrict yi = &py[i * W];
+			real fxi[W] = {}, fyi[W] = {};
+			real peRow[W] = {};
+			for (int j = i + 1; j < N; ++j)
+			{
+				const real* __restrict xj = &px[j * W];
+				const real* __restrict yj = &py[j * W];
+				real* __restrict fxj = &ax[j * W];
+				real* __restrict fyj = &ay[j * W];
+				for (int l = 0; l < W; ++l)
+				{
+					real dx = xi[l] - xj[l];
+					real dy = yi[l] - yj[l];
+					dx -= dx > halfX ? Lx : (dx < -halfX ? -Lx : real(0));
+					dy -= dy > halfY ? Ly : (dy < -halfY ? -Ly : real(0));
+					const real r2 = dx * dx + dy * dy;
+					const bool bInRange = r2 <= rc2 && xi[l] <= Lx && xj[l] <= Lx;
+					// Same as F(): force / r = 24 (sigma/r)^2 (sigma/r)^6 (2 (sigma/r)^6 - 1)
+					const real rinv2 = sigma2 / r2;
+					const real r6 = rinv2 * rinv2 * rinv2;
+					const real force = bInRange ? real(24.0) * rinv2 * r6 * (real(2.0) * r6 - real(1.0)) : real(0);
+					fxi[l] += force * dx;
+					fyi[l] += force * dy;
+					fxj[l] -= force * dx;
+					fyj[l] -= force * dy;
+					peRow[l] += (bInRange && xi[l] < Lx && xj[l] < Lx) ? epsilon * r6 * (r6 - real(1.0)) : real(0);
+				}
+			}
+			real* __restrict fx = &ax[i * W];
+			real* __restrict fy = &ay[i * W];
+			for (int l = 0; l < W; ++l)
+			{
+				fx[l] += fxi[l];
+				fy[l] += fyi[l];
+				peLane[l] += peRow[l];
+			}
+		}
+		for (int l = 0; l < W; ++l)
+			peOut[l] += peLane[l];
+	}
+	void Kick()
+	{
+		real maxForce;
+		{
+			real rinv = real(1.0) / explosionProtectionThreshold;
+			real r6 = rinv * rinv * rinv * rinv * rinv * rinv;
+			maxForce = real(24.0) * rinv * r6 * (real(2.0) * r6 - real(1.0)) * rinv;
+		}
+		const real maxForce2 = maxForce * maxForce;
+		const real escapeX = CompactsEscaped() ? Lx * real(1.05) : (std::numeric_limits<real>::max)();
+		const real boxX = Lx * real(1.05);
+		double keLane[W] = {}, virialLane[W] = {};
+		int inBoxLane[W] = {};
+		for (int i = 0; i < N; ++i)
+		{
+			const real* __restrict x = &px[i * W];
+			const real* __restrict y = &py[i * W];
+			real* __restrict u = &vx[i * W];
+			real* __restrict v = &vy[i * W];
+			real* __restrict fx = &ax[i * W];
+			real* __restrict fy = &ay[i * W];
+			for (int l = 0; l < W; ++l)
+			{
+				const bool bActive = x[l] < escapeX;
+				const real a2 = fx[l] * fx[l] + fy[l] * fy[l];
+				const real scale = a2 >= maxForce2 ? maxForce / std::sqrt(a2) : real(1);
+				fx[l] = bActive ? fx[l] * scale : real(0);
+				fy[l] = bActive ? fy[l] * scale : real(0);
+				u[l] += real(0.5) * fx[l] * dt[l];
+				v[l] += real(0.5) * fy[l] * dt[l];
+				keLane[l] += x[l] < Lx ? real(0.5) * (u[l] * u[l] + v[l] * v[l]) : real(0);
+				virialLane[l] += x[l] * fx[l] + y[l] * fy[l];
+				inBoxLane[l] += x[l] < boxX ? 1 : 0;
+			}
+		}
+		for (int l = 0; l < W; ++l)
+		{
+			ke[l] += keLane[l];
+			virial[l] += virialLane[l];
+			numInBox[l] = inBoxLane[l];
+		}
+	}
+	void AdjustTimeStep()
+	{
+		const real escapeX = CompactsEscaped() ? Lx * real(1.05) : (std::numeric_limits<real>::max)();
+		real Amax[W] = {}, Vmax[W] = {};
+		for (int i = 0; i < N; ++i)
+		{
+			const real* __restrict x = &px[i * W];
+			const real* __restrict u = &vx[i * W];
+			const real* __restrict v = &vy[i * W];
+			const real* __restrict fx = &ax[i * W];
+			const real* __restrict fy = &ay[i * W];
+			for (int l = 0; l < W; ++l)
+			{
+				const bool bActive = x[l] < escapeX;
+				const real v2 = bActive ? u[l] * u[l] + v[l] * v[l] : real(0);
+				const real a2 = bActive ? fx[l] * fx[l] + fy[l] * fy[l] : real(0);
+				Vmax[l] = v2 > Vmax[l] ? v2 : Vmax[l];
+				Amax[l] = a2 > Amax[l] ? a2 : Amax[l];
+			}
+		}
+		const real Lmin = (std::min)(Lx, Ly);
+		for (int l = 0; l < W; ++l)
+		{
+			dt[l] = (Lmin / (std::sqrt(std::sqrt(Amax[l])) * 2 + std::sqrt(Vmax[l]))) * ATSPathThreshold;
+			dt2[l] = dt[l] * dt[l];
+		}
+	}
+	void UpdateStats()
+	{
+		const bool bAdd = ++updatesDone > averageWarmup;
+		for (int l = 0; l < W; ++l)
+		{
+			const double keAvg = ke[l] / nAvg;
+			const double peAvg = pe[l] / nAvg;
+			real T = real(keAvg / N);
+			const double E = (peAvg + keAvg) / N;
+			if (!bHaveInitialEnergy)
+				initialEnergy[l] = E;
+			std::map<std::string, real>& laneStats = stats[l];
+			laneStats["E"] = real(E);
+			laneStats["T"] = T;
+			laneStats["pvirial"] = (N * T) / (Lx * Ly) + real(0.5 * virial[l] / (nAvg * Lx * Ly));
+			laneStats["Time"] = real(_time[l]);
+			laneStats["In box"] = real(numInBox[l]);
+			laneStats["E drift"] = real(initialEnergy[l] != 0 ? (E - initialEnergy[l]) / std::abs(initialEnergy[l]) : E);
+			laneStats["Force evals"] = real(forceEvaluations);
+			ke[l] = pe[l] = virial[l] = 0;
+
+			for (size_t k = 0; k < averagedNames.size(); ++k)
+			{
+				BlockAverager& blocks = averages[k * W + l];
+				auto stat = laneStats.find(averagedNames[k]);
+				if (bAdd && stat != laneStats.end())
+					blocks.Add(stat->second);
+				laneStats[averagedNames[k] + " mean"] = blocks.Count() > 0 ? real(blocks.Mean()) : std::numeric_limits<real>::quiet_NaN();
+				laneStats[averagedNames[k] + " error"] = real(blocks.Error());
+			}
+		}
+		bHaveInitialEnergy = true;
+	}
+
+public:
+	static int Lanes() { return W; }
+
+	// Reads the VERLET section without writing the file back, seeds has W entries
+	void Initialize(const std::string& filename, const unsigned int* seeds)
+	{
+		inipp::Ini<char> ini;
+		{
+			struct stat buffer;
+			if (stat(filename.c_str(), &buffer) == 0)
+				ini.parse(std::ifstream(filename));
+		}
+		real dtInit;
+		int nRow;
+		real vMax;
+		InitializeValue("VERLET", "N", N, 10, ini);
+		InitializeValue("VERLET", "Lx", Lx, real(1.0), ini);
+		InitializeValue("VERLET", "Ly", Ly, real(1.0), ini);
+		InitializeValue("VERLET", "dt", dtInit, real(0.0167), ini);
+		InitializeValue("VERLET", "nAvg", nAvg, 4, ini);
+		InitializeValue("VERLET", "bUseAdaptiveTimeStep", bUseAdaptiveTimeStep, 1, ini);
+		InitializeValue("VERLET", "sigma", sigma, real(sigma), ini);
+		InitializeValue("VERLET", "epsilon", epsilon, real(epsilon), ini);
+		InitializeValue("VERLET", "ATSPathThreshold", ATSPathThreshold, real(0.00015), ini);
+		InitializeValue("VERLET", "edgeCondition", edgeCondition, 0, ini);
+		InitializeValue("VERLET", "explosionProtectionThreshold", explosionProtectionThreshold, real(explosionProtectionThreshold), ini);
+		InitializeValue("VERLET", "cutoffRadius", cutoffRadius, real(0.0), ini);
+		InitializeValue("VERLET", "nRow", nRow, 2, ini);
+		InitializeValue("VERLET", "vMax", vMax, real(0.5), ini);
+		InitializeValue("VERLET", "initPoxScale", initPoxScale, real(0.5), ini);
+		std::string averagedStats;
+		InitializeValue("VERLET", "averagedStats", averagedStats, std::string("E, T, pvirial, In box"), ini);
+		InitializeValue("VERLET", "averageWarmup", averageWarmup, 0, ini);
+
+		averagedNames.clear();
+		for (const std::string& name : SplitList(averagedStats))
+			if (name != "none")
+				averagedNames.push_back(name);
+		averages.assign(averagedNames.size() * W, BlockAverager());
+		updatesDone = 0;
+		bHaveInitialEnergy = false;
+		forceEvaluations = 0;
+
+		px.assign(N * W, 0); py.assign(N * W, 0);
+		vx.assign(N * W, 0); vy.assign(N * W, 0);
+		ax.assign(N * W, 0); ay.assign(N * W, 0);
+		stats.assign(W, std::map<std::string, real>());
+		InitPos(nRow, vMax, seeds);
+
+		for (int l = 0; l < W; ++l)
+		{
+			dt[l] = dtInit;
+			dt2[l] = dtInit * dtInit;
+			ke[l] = pe[l] = virial[l] = _time[l] = 0;
+			numInBox[l] = N;
+		}
+		Accel(pe);
+		for (int l = 0; l < W; ++l)
+			pe[l] = 0;
+	}
+	void Update()
+	{
+		for (int iAvg = 0; iAvg < nAvg; ++iAvg)
+		{
+			if (bUseAdaptiveTimeStep)
+				AdjustTimeStep();
+			Drift();
+			Accel(pe);
+			++forceEvaluations;
+			Kick();
+			for (int l = 0; l < W; ++l)
+				_time[l] += dt[l];
+		}
+		UpdateStats();
+	}
+
+	int GetN() const { return N; }
+	real GetDt(int lane) const { return dt[lane]; }
+	const std::map<std::string, real>& GetStats(int lane) const { return stats[lane]; }
+	Vector2<real> GetPosition(int i, int lane) const { return { px[i * W + lane], py[i * W + lane] }; }
+	Vector2<real> GetVelocity(int i, int lane) const { return { vx[i * W + lane], vy[i * W + lane] }; }
+};
@@ -0,0 +1,91 @@
+#pragma once
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Streaming Flyvbjerg-Petersen blocking of one observable. Level 0 sees every sample, level k
+// the means of pairs from level k - 1, so a run of 2^MaxLevels samples fits in fixed memory.
+// Correlated samples make the naive error of level 0 too small, it grows with the level
+// until the blocks are longer than the correlation time and then stays flat. Error() looks
+// for that plateau among the levels that still have MinBlocks blocks, a run too short to
+// reach it gets the last of those.
+class BlockAverager
+{
+public:
+	static const int MaxLevels = 40;
+	static const int MinBlocks = 16;
+
+private:
+	struct Level
+	{
+		long long n = 0;
+		double mean = 0;
+		// Sum of squared deviations from the mean, Welford's update
+		double m2 = 0;
+		double pending = 0;
+		bool bPending = false;
+	};
+	Level levels[MaxLevels];
+
+public:
+	void Reset()
+	{
+		for (Level& level : levels)
+			level = Level();
+	}
+	void Add(double x)
+	{
+		for (int k = 0; k < MaxLevels; ++k)
+		{
+			Level& level = levels[k];
+			++level.n;
+			const double delta = x - level.mean;
+			level.mean += delta / level.n;
+			level.m2 += delta * (x - level.mean);
+			if (!level.bPending)
+			{
+				level.pending = x;
+				level.bPending = true;
+				return;
+			}
+			x = 0.5 * (level.pending + x);
+			level.bPending = false;
+		}
+	}
+
+	long long Count() const { return levels[0].n; }
+	double Mean() const { return levels[0].mean; }
+	double Variance() const { return levels[0].n > 1 ? levels[0].m2 / (levels[0].n - 1) : 0.0; }
+	// Levels that have blocks in them
+	int NumLevels() const
+	{
+		int k = 0;
+		while (k < MaxLevels && levels[k].n > 0)
+			++k;
+		return k;
+	}
+	// Standard error of the mean if the blocks of level k were independent
+	double LevelError(int k) const
+	{
+		const Level& level = levels[k];
+		return level.n > 1 ? std::sqrt(level.m2 / (double(level.n) * (level.n - 1))) : 0.0;
+	}
+	// Infinite until level 1 has MinBlocks blocks, a single level says nothing about correlations.
+	// The first level the next one doesn't rise above by more than its own uncertainty
+	// is taken as the plateau
+	double Error() const
+	{
+		if (levels[1].n < MinBlocks)
+			return (std::numeric_limits<double>::infinity)();
+		int k = 0;
+		while (k + 1 < MaxLevels && levels[k + 1].n >= MinBlocks)
+		{
+			const double error = LevelError(k);
+			const double uncertainty = error / std::sqrt(2.0 * (levels[k].n - 1));
+			if (LevelError(k + 1) <= error + uncertainty)
+				break;
+			++k;
+		}
+		return LevelError(k);
+	}
+};
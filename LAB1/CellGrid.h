@@ -0,0 +1,129 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "Types.h"
+
+// Uniform grid over the box with particles binned by a counting sort.
+// Every cell keeps a list of partner cells: itself plus the higher-numbered cells it has
+// to be paired with. Walking those lists visits each candidate pair exactly once.
+template<typename real>
+struct CellGrid
+{
+	int nx = 0;
+	int ny = 0;
+	Vector2<real> cellSize;
+
+	std::vector<int> cellStart;
+	std::vector<int> items;
+	std::vector<int> partnerStart;
+	std::vector<int> partners;
+
+	int NumCells() const { return nx * ny; }
+	int Count(int cell) const { return cellStart[cell + 1] - cellStart[cell]; }
+
+	// Cells no smaller than minCellSize, partners are the 3x3 neighbourhood
+	void SetupNeighbourhood(const Vector2<real>& L, real minCellSize, bool bWrapX, bool bWrapY)
+	{
+		const int maxCellsPerSide = 1024;
+		nx = (std::max)(1, (std::min)(maxCellsPerSide, int(L.x / minCellSize)));
+		ny = (std::max)(1, (std::min)(maxCellsPerSide, int(L.y / minCellSize)));
+		cellSize = { L.x / nx, L.y / ny };
+
+		partnerStart.assign(1, 0);
+		partners.clear();
+		std::vector<int> stencil;
+		for (int cy = 0; cy < ny; ++cy)
+			for (int cx = 0; cx < nx; ++cx)
+			{
+				const int cell = cy * nx + cx;
+				stencil.clear();
+				for (int dy = -1; dy <= 1; ++dy)
+					for (int dx = -1; dx <= 1; ++dx)
+					{
+						int ox = cx + dx;
+						int oy = cy + dy;
+						if (ox < 0 || ox >= nx)
+						{
+							if (!bWrapX) continue;
+							ox = (ox + nx) % nx;
+						}
+						if (oy < 0 || oy >= ny)
+						{
+							if (!bWrapY) continue;
+							oy = (oy + ny) % ny;
+						}
+						const int other = oy * nx + ox;
+						if (other >= cell)
+							stencil.push_back(other);
+					}
+				// Narrow periodic grids reach the same cell from both sides
+				std::sort(stencil.begin(), stencil.end());
+				stencil.erase(std::unique(stencil.begin(), stencil.end()), stencil.end());
+				partners.insert(partners.end(), stencil.begin(), stencil.end());
+				partnerStart.push_back(int(partners.size()));
+			}
+	}
+	// Coarse blocks without a cutoff, every block pairs with itself and all blocks after it
+	void SetupAllPairs(const Vector2<real>& L, int nBlocksX, int nBlocksY)
+	{
+		nx = (std::max)(1, nBlocksX);
+		ny = (std::max)(1, nBlocksY);
+		cellSize = { L.x / nx, L.y / ny };
+
+		partnerStart.assign(1, 0);
+		partners.clear();
+		for (int cell = 0; cell < NumCells(); ++cell)
+		{
+			for (int other = cell; other < NumCells(); ++other)
+				partners.push_back(other);
+			partnerStart.push_back(int(partners.size()));
+		}
+	}
+
+	// Positions outside the box are clamped to the border cells, which keeps adjacency intact
+	int CellOf(const Vector2<real>& p) const
+	{
+		int ix = int(p.x / cellSize.x);
+		int iy = int(p.y / cellSize.y);
+		ix = (std::max)(0, (std::min)(nx - 1, ix));
+		iy = (std::max)(0, (std::min)(ny - 1, iy));
+		return iy * nx + ix;
+	}
+
+	// Every cell the box [lo, hi] overlaps, with the same clamping as CellOf()
+	template<typename Fn>
+	void ForEachCellIn(const Vector2<real>& lo, const Vector2<real>& hi, Fn&& fn) const
+	{
+		const int first = CellOf(lo);
+		const int last = CellOf(hi);
+		for (int iy = first / nx; iy <= last / nx; ++iy)
+			for (int ix = first % nx; ix <= last % nx; ++ix)
+				fn(iy * nx + ix);
+	}
+
+	// Bins particles [0, n), inside a cell they keep ascending index order
+	template<typename Container>
+	void Build(const Container& comps, int n)
+	{
+		if (int(particleCell.size()) < n)
+			particleCell.resize(n);
+		cellStart.assign(NumCells() + 1, 0);
+		for (int i = 0; i < n; ++i)
+		{
+			const int cell = CellOf(comps[i].p);
+			particleCell[i] = cell;
+			++cellStart[cell + 1];
+		}
+		for (int cell = 0; cell < NumCells(); ++cell)
+			cellStart[cell + 1] += cellStart[cell];
+
+		fill.assign(cellStart.begin(), cellStart.end() - 1);
+		items.resize(n);
+		for (int i = 0; i < n; ++i)
+			items[fill[particleCell[i]]++] = i;
+	}
+
+private:
+	std::vector<int> particleCell;
+	std::vector<int> fill;
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <utility>
+
+// Disjoint sets that any number of threads can unite at once without locks.
+// A root is only ever linked below a smaller index by compare-and-swap, so the sets that come
+// out don't depend on the order the unions ran in, and every set ends up rooted at its smallest
+// member. Finds halve the path as they go.
+class ConcurrentUnionFind
+{
+	std::vector<std::atomic<int>> parent;
+
+public:
+	int Size() const { return int(parent.size()); }
+	void Resize(int n)
+	{
+		if (int(parent.size()) != n)
+			std::vector<std::atomic<int>>(n).swap(parent);
+	}
+	// Not thread-safe against unions running on i
+	void Reset(int i) { parent[i].store(i, std::memory_order_relaxed); }
+
+	int Find(int i)
+	{
+		int p = parent[i].load(std::memory_order_relaxed);
+		while (p != i)
+		{
+			const int grandparent = parent[p].load(std::memory_order_relaxed);
+			if (grandparent != p)
+				parent[i].compare_exchange_weak(p, grandparent, std::memory_order_relaxed);
+			i = p;
+			p = parent[i].load(std::memory_order_relaxed);
+		}
+		return i;
+	}
+	void Unite(int a, int b)
+	{
+		for (;;)
+		{
+			a = Find(a);
+			b = Find(b);
+			if (a == b)
+				return;
+			if (a < b)
+				std::swap(a, b);
+			// a is a root right now unless another thread just linked it, then try again
+			int expected = a;
+			if (parent[a].compare_exchange_strong(expected, b, std::memory_order_relaxed))
+				return;
+		}
+	}
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// Undirected graph over particles built from a list of pairs, with every particle's neighbours
+// in ascending index order. The pairs can be coloured so that no two pairs of one colour share a
+// particle. Colours are greedy in pair order, the same pairs always give the same colours.
+struct ContactGraph
+{
+	std::vector<int> start;
+	std::vector<int> neighbours;
+
+	int nColours = 0;
+	// Pair indices grouped by colour, ascending inside a colour
+	std::vector<int> colourStart;
+	std::vector<int> colourItems;
+
+	int Degree(int i) const { return start[i + 1] - start[i]; }
+
+	void Build(const std::vector<std::pair<int, int>>& pairs, int n)
+	{
+		start.assign(n + 1, 0);
+		for (const std::pair<int, int>& pair : pairs)
+		{
+			++start[pair.first + 1];
+			++start[pair.second + 1];
+		}
+		for (int i = 0; i < n; ++i)
+			start[i + 1] += start[i];
+
+		fill.assign(start.begin(), start.end() - 1);
+		neighbours.resize(start[n]);
+		for (const std::pair<int, int>& pair : pairs)
+		{
+			neighbours[fill[pair.first]++] = pair.second;
+			neighbours[fill[pair.second]++] = pair.first;
+		}
+		for (int i = 0; i < n; ++i)
+			std::sort(neighbours.begin() + start[i], neighbours.begin() + start[i + 1]);
+		nColours = 0;
+	}
+
+	// pairs has to be the list the graph was built from. Every pair takes the lowest colour
+	// that no earlier pair on either of its particles has
+	void ColourPairs(const std::vector<std::pair<int, int>>& pairs)
+	{
+		const int nPairs = int(pairs.size());
+		slotColour.assign(neighbours.size(), -1);
+		pairColour.resize(nPairs);
+		taken.clear();
+		nColours = 0;
+		for (int p = 0; p < nPairs; ++p)
+		{
+			const int i = pairs[p].first;
+			const int j = pairs[p].second;
+			for (int k = start[i]; k < start[i + 1]; ++k)
+				if (slotColour[k] >= 0)
+					taken[slotColour[k]] = p;
+			for (int k = start[j]; k < start[j + 1]; ++k)
+				if (slotColour[k] >= 0)
+					taken[slotColour[k]] = p;
+			int c = 0;
+			while (c < nColours && taken[c] == p)
+				++c;
+			if (c == nColours)
+			{
+				++nColours;
+				taken.push_back(-1);
+			}
+			pairColour[p] = c;
+			slotColour[Slot(i, j)] = c;
+			slotColour[Slot(j, i)] = c;
+		}
+
+		colourStart.assign(nColours + 1, 0);
+		for (int p = 0; p < nPairs; ++p)
+			++colourStart[pairColour[p] + 1];
+		for (int c = 0; c < nColours; ++c)
+			colourStart[c + 1] += colourStart[c];
+		fill.assign(colourStart.begin(), colourStart.end() - 1);
+		colourItems.resize(nPairs);
+		for (int p = 0; p < nPairs; ++p)
+			colourItems[fill[pairColour[p]]++] = p;
+	}
+
+private:
+	std::vector<int> fill;
+	std::vector<int> slotColour;
+	std::vector<int> pairColour;
+	// Last pair that found the colour on one of its particles
+	std::vector<int> taken;
+
+	// Where j sits among i's neighbours
+	int Slot(int i, int j) const
+	{
+		return int(std::lower_bound(neighbours.begin() + start[i], neighbours.begin() + start[i + 1], j) - neighbours.begin());
+	}
+};
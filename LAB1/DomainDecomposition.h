@@ -0,0 +1,617 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include "Types.h"
+#ifdef _WIN32
+// Needs a windows.h included before it to be WIN32_LEAN_AND_MEAN, freeglut includes it that way.
+// AF_UNIX sockets are there since Windows 10 1803
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// The few socket calls that differ between Winsock and POSIX
+#ifdef _WIN32
+typedef SOCKET SocketHandle;
+typedef WSAPOLLFD SocketPollFd;
+const SocketHandle NoSocket = INVALID_SOCKET;
+inline bool SocketStartup()
+{
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+}
+inline void SocketCleanup() { WSACleanup(); }
+inline void CloseSocket(SocketHandle s) { closesocket(s); }
+inline void SetNonBlocking(SocketHandle s)
+{
+	u_long on = 1;
+	ioctlsocket(s, FIONBIO, &on);
+}
+inline long long SocketSend(SocketHandle s, const char* data, size_t bytes) { return ::send(s, data, int(bytes), 0); }
+inline long long SocketRecv(SocketHandle s, char* data, size_t bytes) { return ::recv(s, data, int(bytes), 0); }
+inline int SocketPoll(SocketPollFd* fds, size_t n, int timeoutMs) { return WSAPoll(fds, ULONG(n), timeoutMs); }
+inline bool SocketInterrupted() { return WSAGetLastError() == WSAEINTR; }
+inline bool SocketWouldBlock()
+{
+	const int error = WSAGetLastError();
+	return error == WSAEWOULDBLOCK || error == WSAEINTR;
+}
+inline void RemoveSocketFile(const std::string& path) { DeleteFileA(path.c_str()); }
+#else
+typedef int SocketHandle;
+typedef pollfd SocketPollFd;
+const SocketHandle NoSocket = -1;
+inline bool SocketStartup() { return true; }
+inline void SocketCleanup() {}
+inline void CloseSocket(SocketHandle s) { close(s); }
+inline void SetNonBlocking(SocketHandle s) { fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK); }
+inline long long SocketSend(SocketHandle s, const char* data, size_t bytes) { return ::send(s, data, bytes, MSG_NOSIGNAL); }
+inline long long SocketRecv(SocketHandle s, char* data, size_t bytes) { return ::recv(s, data, bytes, 0); }
+inline int SocketPoll(SocketPollFd* fds, size_t n, int timeoutMs) { return poll(fds, nfds_t(n), timeoutMs); }
+inline bool SocketInterrupted() { return errno == EINTR; }
+inline bool SocketWouldBlock() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR; }
+inline void RemoveSocketFile(const std::string& path) { unlink(path.c_str()); }
+#endif
+
+// Where the sockets go when domainSocketPath is empty, the temp directory of the platform
+inline std::string DefaultSocketPath()
+{
+#ifdef _WIN32
+	char dir[MAX_PATH];
+	const DWORD length = GetTempPathA(MAX_PATH, dir);
+	return (length > 0 && length < MAX_PATH ? std::string(dir) : std::string(".\\")) + "verlet_domain";
+#else
+	return "/tmp/verlet_domain";
+#endif
+}
+
+// Moves bytes between the processes of a decomposed run. Every rank calls AllToAll
+// at the same point of the step with one buffer per rank, its own one is ignored.
+struct ITransport
+{
+	virtual ~ITransport() {}
+	virtual int Rank() const abstract;
+	virtual int Size() const abstract;
+	// False once a peer is gone, there is no way to carry on after that
+	virtual bool AllToAll(const std::vector<std::vector<char>>& send, std::vector<std::vector<char>>& recv) abstract;
+};
+
+// Processes of one run are started separately, each with VERLET_RANK set
+inline int RankFromEnvironment()
+{
+	int rank = 0;
+#ifdef _WIN32
+	char* value = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&value, &length, "VERLET_RANK") == 0 && value)
+	{
+		rank = atoi(value);
+		free(value);
+	}
+#else
+	if (const char* value = getenv("VERLET_RANK"))
+		rank = atoi(value);
+#endif
+	return rank;
+}
+
+// Full mesh of Unix domain sockets between processes on one machine, Winsock's AF_UNIX on Windows.
+// Rank r listens on <basePath>.<r>, connects to every lower rank and accepts every higher one.
+class UnixSocketTransport : public ITransport
+{
+	bool bLibrary = false;
+	int rank = 0;
+	int size = 1;
+	std::string listenPath;
+	SocketHandle listenFd = NoSocket;
+	std::vector<SocketHandle> peerFds;
+	bool bFailed = false;
+
+	// Messages go out as an 8 byte length followed by the payload
+	std::vector<std::vector<char>> outgoing;
+	std::vector<size_t> sentBytes;
+	std::vector<size_t> receivedBytes;
+	std::vector<uint64_t> incomingLength;
+	std::vector<SocketPollFd> pollFds;
+	std::vector<int> pollPeers;
+
+	static std::string SocketPath(const std::string& basePath, int r) { return basePath + "." + std::to_string(r); }
+	static bool FillAddress(sockaddr_un& addr, const std::string& path)
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			return false;
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		return true;
+	}
+	// Blocking, only used for the handshake before the sockets go non-blocking
+	static bool WriteAll(SocketHandle fd, const void* data, size_t bytes)
+	{
+		const char* p = (const char*)data;
+		while (bytes > 0)
+		{
+			long long n = SocketSend(fd, p, bytes);
+			if (n < 0 && SocketInterrupted())
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			bytes -= size_t(n);
+		}
+		return true;
+	}
+	static bool ReadAll(SocketHandle fd, void* data, size_t bytes)
+	{
+		char* p = (char*)data;
+		while (bytes > 0)
+		{
+			long long n = SocketRecv(fd, p, bytes);
+			if (n < 0 && SocketInterrupted())
+				continue;
+			if (n <= 0)
+				return false;
+			p += n;
+			bytes -= size_t(n);
+		}
+		return true;
+	}
+	bool Fail(int peer)
+	{
+		if (!bFailed)
+			std::cout << "Rank " << rank << " lost connection to rank " << peer << std::endl;
+		bFailed = true;
+		return false;
+	}
+	bool ReceiveDone(int peer) const
+	{
+		return receivedBytes[peer] >= sizeof(uint64_t) && receivedBytes[peer] - sizeof(uint64_t) == incomingLength[peer];
+	}
+
+public:
+	UnixSocketTransport(const std::string& basePath, int newRank, int newSize, int timeoutSeconds)
+		: rank(newRank), size(newSize)
+	{
+		peerFds.assign(size, NoSocket);
+		bLibrary = SocketStartup();
+		if (!bLibrary)
+		{
+			std::cout << "Sockets aren't available" << std::endl;
+			bFailed = true;
+			return;
+		}
+		listenPath = SocketPath(basePath, rank);
+		sockaddr_un addr;
+		if (!FillAddress(addr, listenPath))
+		{
+			std::cout << "Socket path is too long: " << listenPath << std::endl;
+			bFailed = true;
+			return;
+		}
+		RemoveSocketFile(listenPath);
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenFd == NoSocket || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, size) != 0)
+		{
+			std::cout << "Can't listen on " << listenPath << std::endl;
+			bFailed = true;
+			return;
+		}
+
+		// Lower ranks may not be up yet (or left a stale socket behind), retry until the deadline
+		const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+		for (int peer = 0; peer < rank && !bFailed; ++peer)
+		{
+			sockaddr_un peerAddr;
+			FillAddress(peerAddr, SocketPath(basePath, peer));
+			while (peerFds[peer] == NoSocket)
+			{
+				SocketHandle fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				if (fd != NoSocket && connect(fd, (sockaddr*)&peerAddr, sizeof(peerAddr)) == 0)
+				{
+					peerFds[peer] = fd;
+					break;
+				}
+				if (fd != NoSocket)
+					CloseSocket(fd);
+				if (std::chrono::steady_clock::now() > deadline)
+				{
+					std::cout << "Rank " << peer << " didn't come up in " << timeoutSeconds << " s" << std::endl;
+					bFailed = true;
+					break;
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			}
+			if (peerFds[peer] != NoSocket && !WriteAll(peerFds[peer], &rank, sizeof(rank)))
+				Fail(peer);
+		}
+		for (int k = rank + 1; k < size && !bFailed; ++k)
+		{
+			const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+			SocketPollFd p = { listenFd, POLLIN, 0 };
+			if (SocketPoll(&p, 1, (std::max)(int(left.count()), 0)) <= 0)
+			{
+				std::cout << "Rank " << rank << " timed out waiting for higher ranks" << std::endl;
+				bFailed = true;
+				break;
+			}
+			SocketHandle fd = accept(listenFd, nullptr, nullptr);
+			int peer = -1;
+			if (fd == NoSocket || !ReadAll(fd, &peer, sizeof(peer)) || peer <= rank || peer >= size || peerFds[peer] != NoSocket)
+			{
+				std::cout << "Rank " << rank << " got a bad handshake" << std::endl;
+				if (fd != NoSocket)
+					CloseSocket(fd);
+				bFailed = true;
+				break;
+			}
+			peerFds[peer] = fd;
+		}
+		for (SocketHandle fd : peerFds)
+			if (fd != NoSocket)
+				SetNonBlocking(fd);
+
+		outgoing.resize(size);
+		sentBytes.assign(size, 0);
+		receivedBytes.assign(size, 0);
+		incomingLength.assign(size, 0);
+	}
+	virtual ~UnixSocketTransport()
+	{
+		for (SocketHandle fd : peerFds)
+			if (fd != NoSocket)
+				CloseSocket(fd);
+		if (listenFd != NoSocket)
+		{
+			CloseSocket(listenFd);
+			RemoveSocketFile(listenPath);
+		}
+		if (bLibrary)
+			SocketCleanup();
+	}
+
+	bool Connected() const { return !bFailed; }
+	virtual int Rank() const override { return rank; }
+	virtual int Size() const override { return size; }
+
+	// Sends and receives to all peers at once with poll, so nobody blocks on a full socket
+	virtual bool AllToAll(const std::vector<std::vector<char>>& send, std::vector<std::vector<char>>& recv) override
+	{
+		if (bFailed)
+			return false;
+		recv.resize(size);
+		recv[rank].clear();
+		for (int peer = 0; peer < size; ++peer)
+		{
+			if (peer == rank)
+				continue;
+			const uint64_t length = send[peer].size();
+			outgoing[peer].resize(sizeof(length) + send[peer].size());
+			memcpy(outgoing[peer].data(), &length, sizeof(length));
+			if (length > 0)
+				memcpy(outgoing[peer].data() + sizeof(length), send[peer].data(), send[peer].size());
+			sentBytes[peer] = 0;
+			receivedBytes[peer] = 0;
+			incomingLength[peer] = 0;
+		}
+
+		for (;;)
+		{
+			pollFds.clear();
+			pollPeers.clear();
+			for (int peer = 0; peer < size; ++peer)
+			{
+				if (peer == rank)
+					continue;
+				short events = 0;
+				if (sentBytes[peer] < outgoing[peer].size())
+					events |= POLLOUT;
+				if (!ReceiveDone(peer))
+					events |= POLLIN;
+				if (events != 0)
+				{
+					SocketPollFd p = { peerFds[peer], events, 0 };
+					pollFds.push_back(p);
+					pollPeers.push_back(peer);
+				}
+			}
+			if (pollFds.empty())
+				return true;
+			if (SocketPoll(pollFds.data(), pollFds.size(), -1) < 0)
+			{
+				if (SocketInterrupted())
+					continue;
+				return Fail(-1);
+			}
+
+			for (size_t k = 0; k < pollFds.size(); ++k)
+			{
+				const int peer = pollPeers[k];
+				const SocketHandle fd = pollFds[k].fd;
+				const short revents = pollFds[k].revents;
+				if (revents & POLLOUT)
+				{
+					long long n = SocketSend(fd, outgoing[peer].data() + sentBytes[peer], outgoing[peer].size() - sentBytes[peer]);
+					if (n > 0)
+						sentBytes[peer] += size_t(n);
+					else if (!SocketWouldBlock())
+						return Fail(peer);
+				}
+				if ((revents & (POLLIN | POLLHUP | POLLERR)) && !ReceiveDone(peer))
+				{
+					// Length first, then exactly that many bytes, the next message stays in the socket
+					char* dst;
+					size_t want;
+					if (receivedBytes[peer] < sizeof(uint64_t))
+					{
+						dst = (char*)&incomingLength[peer] + receivedBytes[peer];
+						want = sizeof(uint64_t) - receivedBytes[peer];
+					}
+					else
+					{
+						dst = recv[peer].data() + (receivedBytes[peer] - sizeof(uint64_t));
+						want = size_t(incomingLength[peer]) - (receivedBytes[peer] - sizeof(uint64_t));
+					}
+					long long n = SocketRecv(fd, dst, want);
+					if (n == 0)
+						return Fail(peer);
+					if (n < 0)
+					{
+						if (!SocketWouldBlock())
+							return Fail(peer);
+						continue;
+					}
+					receivedBytes[peer] += size_t(n);
+					if (receivedBytes[peer] == sizeof(uint64_t))
+						recv[peer].resize(size_t(incomingLength[peer]));
+				}
+			}
+		}
+	}
+};
+
+// Box split into domainsX x domainsY rectangles, one per process. A rank owns the particles
+// inside its rectangle and gets copies (ghosts) of the ones other ranks own within haloWidth of it.
+// Ghosts are stored right after the owned particles and don't carry forces back.
+template<typename real>
+class DomainDecomposition
+{
+	std::unique_ptr<ITransport> transport;
+	std::string transportPath;
+	int nx = 1;
+	int ny = 1;
+	int rank = 0;
+
+	Vector2<real> L;
+	Vector2<real> domainSize;
+	bool bWrapX = false;
+	bool bWrapY = false;
+	real haloWidth = 0;
+	// Ranks whose rectangle comes within haloWidth of ours
+	std::vector<int> haloPeers;
+
+	struct Packet
+	{
+		Component<real> c;
+		int id;
+	};
+	std::vector<std::vector<char>> sendBuffers;
+	std::vector<std::vector<char>> recvBuffers;
+	std::vector<double> reduced;
+	bool bFailed = false;
+
+	// Distance from v to [lo, hi] along one axis, through the wall if the axis wraps
+	real AxisGap(real v, real lo, real hi, real length, bool bWrap) const
+	{
+		real gap = v < lo ? lo - v : (v > hi ? v - hi : real(0));
+		if (bWrap)
+		{
+			real shifted = v + length;
+			gap = (std::min)(gap, shifted < lo ? lo - shifted : (shifted > hi ? shifted - hi : real(0)));
+			shifted = v - length;
+			gap = (std::min)(gap, shifted < lo ? lo - shifted : (shifted > hi ? shifted - hi : real(0)));
+		}
+		return gap;
+	}
+	real GapSqr(const Vector2<real>& p, int r) const
+	{
+		const Vector2<real> lo = Lower(r);
+		const real gx = AxisGap(p.x, lo.x, lo.x + domainSize.x, L.x, bWrapX);
+		const real gy = AxisGap(p.y, lo.y, lo.y + domainSize.y, L.y, bWrapY);
+		return gx * gx + gy * gy;
+	}
+	void Pack(std::vector<char>& buffer, const Component<real>& c, int id)
+	{
+		Packet packet = { c, id };
+		const char* bytes = (const char*)&packet;
+		buffer.insert(buffer.end(), bytes, bytes + sizeof(packet));
+	}
+	bool Exchange()
+	{
+		if (!transport->AllToAll(sendBuffers, recvBuffers))
+		{
+			bFailed = true;
+			return false;
+		}
+		for (auto& buffer : sendBuffers)
+			buffer.clear();
+		return true;
+	}
+	template<typename Comps, typename Ids>
+	int Unpack(Comps& comps, Ids& ids, int at)
+	{
+		for (int r = 0; r < Size(); ++r)
+		{
+			const std::vector<char>& buffer = recvBuffers[r];
+			for (size_t offset = 0; offset + sizeof(Packet) <= buffer.size(); offset += sizeof(Packet))
+			{
+				Packet packet;
+				memcpy(&packet, buffer.data() + offset, sizeof(packet));
+				comps[at] = packet.c;
+				ids[at] = packet.id;
+				++at;
+			}
+		}
+		return at;
+	}
+	void Reduce(double* values, int n, bool bMax)
+	{
+		if (!Active())
+			return;
+		const char* bytes = (const char*)values;
+		for (int r = 0; r < Size(); ++r)
+			sendBuffers[r].assign(bytes, bytes + n * sizeof(double));
+		if (!Exchange())
+			return;
+		// Same order on every rank, so the results are bit-identical everywhere
+		reduced.assign(n, 0.0);
+		for (int r = 0; r < Size(); ++r)
+			for (int k = 0; k < n; ++k)
+			{
+				double v = values[k];
+				if (r != rank)
+					memcpy(&v, recvBuffers[r].data() + k * sizeof(double), sizeof(double));
+				reduced[k] = r == 0 ? v : (bMax ? (std::max)(reduced[k], v) : reduced[k] + v);
+			}
+		for (int k = 0; k < n; ++k)
+			values[k] = reduced[k];
+	}
+
+public:
+	// More than one domain connects to the other ranks, otherwise everything stays local
+	bool Setup(int domainsX, int domainsY, const std::string& socketPath, int timeoutSeconds)
+	{
+		nx = (std::max)(1, domainsX);
+		ny = (std::max)(1, domainsY);
+		const int nRanks = nx * ny;
+		if (nRanks == 1)
+		{
+			transport.reset();
+			rank = 0;
+			return false;
+		}
+		const int newRank = RankFromEnvironment();
+		if (newRank < 0 || newRank >= nRanks)
+		{
+			std::cout << "VERLET_RANK=" << newRank << " is outside of " << nRanks << " domains, running undecomposed" << std::endl;
+			transport.reset();
+			rank = 0;
+			return false;
+		}
+		// Reinitialising keeps the connections if the layout didn't change
+		if (transport && transport->Size() == nRanks && transport->Rank() == newRank && transportPath == socketPath)
+			return true;
+
+		transport.reset();
+		bFailed = false;
+		rank = newRank;
+		transportPath = socketPath;
+		std::cout << "Rank " << rank << " of " << nRanks << " connecting via " << socketPath << std::endl;
+		std::unique_ptr<UnixSocketTransport> sockets(new UnixSocketTransport(socketPath, rank, nRanks, timeoutSeconds));
+		if (!sockets->Connected())
+		{
+			std::cout << "Domain decomposition failed to connect, running undecomposed" << std::endl;
+			rank = 0;
+			return false;
+		}
+		transport = std::move(sockets);
+		sendBuffers.assign(nRanks, std::vector<char>());
+		recvBuffers.assign(nRanks, std::vector<char>());
+		return true;
+	}
+	void SetGeometry(const Vector2<real>& newL, bool bNewWrapX, bool bNewWrapY, real newHaloWidth)
+	{
+		L = newL;
+		domainSize = { L.x / nx, L.y / ny };
+		bWrapX = bNewWrapX;
+		bWrapY = bNewWrapY;
+		haloWidth = newHaloWidth;
+
+		haloPeers.clear();
+		if (!Active())
+			return;
+		const Vector2<real> lo = Lower(rank);
+		for (int r = 0; r < Size(); ++r)
+		{
+			if (r == rank)
+				continue;
+			// Closest approach of two rectangles is the gap of our rectangle's nearest point to theirs
+			const Vector2<real> other = Lower(r);
+			const real gx = (std::max)(real(0), AxisGap(other.x + real(0.5) * domainSize.x, lo.x, lo.x + domainSize.x, L.x, bWrapX) - real(0.5) * domainSize.x);
+			const real gy = (std::max)(real(0), AxisGap(other.y + real(0.5) * domainSize.y, lo.y, lo.y + domainSize.y, L.y, bWrapY) - real(0.5) * domainSize.y);
+			if (gx * gx + gy * gy < haloWidth * haloWidth)
+				haloPeers.push_back(r);
+		}
+	}
+
+	bool Active() const { return transport != nullptr; }
+	bool Failed() const { return bFailed; }
+	int Rank() const { return rank; }
+	int Size() const { return nx * ny; }
+	Vector2<real> Lower(int r) const { return { (r % nx) * domainSize.x, (r / nx) * domainSize.y }; }
+
+	// Positions outside the box go to the border domains, same as CellGrid::CellOf
+	int Owner(const Vector2<real>& p) const
+	{
+		int ix = int(p.x / domainSize.x);
+		int iy = int(p.y / domainSize.y);
+		ix = (std::max)(0, (std::min)(nx - 1, ix));
+		iy = (std::max)(0, (std::min)(ny - 1, iy));
+		return iy * nx + ix;
+	}
+
+	// Hands particles that left the rectangle to their new owner. Ghosts are dropped,
+	// so are escaped particles parked behind nActive by the caller.
+	template<typename Comps, typename Ids>
+	bool Migrate(Comps& comps, Ids& ids, int& nActive)
+	{
+		for (int i = 0; i < nActive;)
+		{
+			const int owner = Owner(comps[i].p);
+			if (owner != rank)
+			{
+				Pack(sendBuffers[owner], comps[i], ids[i]);
+				--nActive;
+				comps[i] = comps[nActive];
+				ids[i] = ids[nActive];
+			}
+			else
+				++i;
+		}
+		if (!Exchange())
+			return false;
+		nActive = Unpack(comps, ids, nActive);
+		return true;
+	}
+	// Refreshes ghosts of the particles other ranks own near our rectangle
+	template<typename Comps, typename Ids>
+	bool ExchangeHalo(Comps& comps, Ids& ids, int nActive, int& nGhost)
+	{
+		const real halo2 = haloWidth * haloWidth;
+		for (int i = 0; i < nActive; ++i)
+			for (int r : haloPeers)
+				if (GapSqr(comps[i].p, r) < halo2)
+					Pack(sendBuffers[r], comps[i], ids[i]);
+		if (!Exchange())
+			return false;
+		nGhost = Unpack(comps, ids, nActive) - nActive;
+		return true;
+	}
+
+	void Sum(double* values, int n) { Reduce(values, n, false); }
+	void Max(double* values, int n) { Reduce(values, n, true); }
+};
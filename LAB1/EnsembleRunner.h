@@ -0,0 +1,298 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <memory>
+#include <vector>
+#include <string>
+#include <map>
+#include <cmath>
+#include <limits>
+#include <omp.h>
+#include "ISimulator.h"
+#include "VerletSimulator.h"
+#include "StepperSimulator.h"
+#include "BatchedVerlet.h"
+#include "ThreadHelpers.h"
+#include "inipp.h"
+#include "IniHelpers.h"
+
+template<typename real>
+struct EnsembleProperties
+{
+	int nReplicas = 8;
+	// 0 VerletSimulator, 1 StepperSimulator
+	int simulatorType = 0;
+	// Observables are taken every sampleTime of simulated time, 0 takes them after every Update()
+	real sampleTime = 0;
+	int nSamples = 100;
+	// Replica r runs with baseSeed + r, 0 draws baseSeed at random
+	int baseSeed = 0;
+	int nThreads = 0;
+	// Verlet replicas go through BatchedVerlet, BatchLanes of them per thread in lockstep.
+	// Those report fewer stats, see BatchedVerlet
+	int bBatched = false;
+	std::string outputPrefix;
+};
+
+// Independent replicas of one config, one per thread. Every replica streams its observables
+// to <outputPrefix>_<r>.txt, the mean and standard error over replicas go to <outputPrefix>_mean.txt
+// as soon as every replica has reached that sample.
+template<typename real>
+class EnsembleRunner : private EnsembleProperties<real>
+{
+	// Lanes per batch, 8 fills a 256 bit register with floats
+	static const int BatchLanes = 8;
+	typedef BatchedVerlet<real, BatchLanes> Batch;
+
+	struct Replica
+	{
+		std::unique_ptr<ISimulator<real>> sim;
+		std::ofstream out;
+		// Time first, then the other stats in map order
+		std::vector<std::vector<real>> samples;
+		int nUpdates = 0;
+	};
+	std::vector<std::unique_ptr<Replica>> replicas;
+	std::string configFilename;
+	// What the replicas are initialized from, the config with the settings that have to be
+	// the same in every replica pinned. Kept next to the outputs
+	std::string replicaConfigFilename;
+	unsigned int firstSeed = 0;
+
+	std::vector<std::string> names;
+	std::vector<int> replicasAtSample;
+	int nextMean = 0;
+	std::ofstream meanOut;
+
+	ISimulator<real>* CreateSimulator() const
+	{
+		if (simulatorType == 1)
+			return new StepperSimulator<real>;
+		return new VerletSimulator<real>;
+	}
+	// Takes every sample point the replica has passed since the last Update().
+	// Stats only change once per Update(), so a long one fills several points with the same values
+	void Record(Replica& rep, const std::map<std::string, real>& stats)
+	{
+		auto timeStat = stats.find("Time");
+		const real time = timeStat != stats.end() ? timeStat->second : real(rep.nUpdates);
+
+		const int first = int(rep.samples.size());
+		while (int(rep.samples.size()) < nSamples)
+		{
+			if (sampleTime > 0 && !(time >= rep.samples.size() * sampleTime))
+				break;
+			std::vector<real> row;
+			row.push_back(time);
+			for (auto& stat : stats)
+				if (stat.first != "Time")
+					row.push_back(stat.second);
+
+			if (rep.samples.empty())
+			{
+				rep.out << "Time";
+				for (auto& stat : stats)
+					if (stat.first != "Time")
+						rep.out << "\t" << stat.first;
+				rep.out << std::endl;
+			}
+			rep.out << row[0];
+			for (size_t k = 1; k < row.size(); ++k)
+				rep.out << "\t" << row[k];
+			rep.out << std::endl;
+
+			rep.samples.push_back(row);
+			if (sampleTime <= 0)
+				break;
+		}
+		if (int(rep.samples.size()) == first)
+			return;
+
+#pragma omp critical(EnsembleOutput)
+		{
+			if (names.empty())
+			{
+				names.push_back("Time");
+				for (auto& stat : stats)
+					if (stat.first != "Time")
+						names.push_back(stat.first);
+				meanOut << "Time";
+				for (size_t k = 1; k < names.size(); ++k)
+					meanOut << "\t" << names[k] << "\t" << names[k] << " err";
+				meanOut << std::endl;
+			}
+			for (int s = first; s < int(rep.samples.size()); ++s)
+				++replicasAtSample[s];
+			while (nextMean < nSamples && replicasAtSample[nextMean] == nReplicas)
+				WriteMean(nextMean++);
+		}
+	}
+	void WriteMean(int s)
+	{
+		// Only the replicas with a finite value count, a block error is infinite until there are blocks
+		std::vector<double> mean(names.size(), 0.0);
+		std::vector<double> sqr(names.size(), 0.0);
+		std::vector<int> count(names.size(), 0);
+		for (auto& rep : replicas)
+			for (size_t k = 0; k < names.size() && k < rep->samples[s].size(); ++k)
+				if (std::isfinite(double(rep->samples[s][k])))
+				{
+					mean[k] += rep->samples[s][k];
+					++count[k];
+				}
+		for (size_t k = 0; k < names.size(); ++k)
+			mean[k] = count[k] > 0 ? mean[k] / count[k] : std::numeric_limits<double>::quiet_NaN();
+		for (auto& rep : replicas)
+			for (size_t k = 0; k < names.size() && k < rep->samples[s].size(); ++k)
+				if (std::isfinite(double(rep->samples[s][k])))
+					sqr[k] += (rep->samples[s][k] - mean[k]) * (rep->samples[s][k] - mean[k]);
+
+		meanOut << (sampleTime > 0 ? double(s * sampleTime) : mean[0]);
+		for (size_t k = 1; k < names.size(); ++k)
+		{
+			const double stdErr = count[k] > 1 ? sqrt(sqr[k] / (count[k] - 1) / count[k]) : 0.0;
+			meanOut << "\t" << mean[k] << "\t" << stdErr;
+		}
+		meanOut << std::endl;
+	}
+
+public:
+	bool Initialize(const std::string& filename)
+	{
+		configFilename = filename;
+		inipp::Ini<char> ini;
+		{
+			struct stat buffer;
+			if (stat(filename.c_str(), &buffer) == 0)
+				ini.parse(std::ifstream(filename));
+		}
+
+		InitializeValue("ENSEMBLE", "nReplicas", nReplicas, 8, ini);
+		InitializeValue("ENSEMBLE", "simulatorType", simulatorType, 0, ini);
+		InitializeValue("ENSEMBLE", "sampleTime", sampleTime, real(0.0), ini);
+		InitializeValue("ENSEMBLE", "nSamples", nSamples, 100, ini);
+		InitializeValue("ENSEMBLE", "baseSeed", baseSeed, 0, ini);
+		InitializeValue("ENSEMBLE", "nThreads", nThreads, 0, ini);
+		InitializeValue("ENSEMBLE", "bBatched", bBatched, 0, ini);
+		InitializeValue("ENSEMBLE", "outputPrefix", outputPrefix, std::string("ensemble"), ini);
+		ini.generate(std::ofstream(filename));
+
+		// Replicas are headless and each one owns a whole process' worth of state
+		if (simulatorType == 0)
+		{
+			int bGPU = 0, domainsX = 1, domainsY = 1;
+			inipp::extract(ini.sections["VERLET"]["bSimulateOnGPU"], bGPU);
+			inipp::extract(ini.sections["VERLET"]["domainsX"], domainsX);
+			inipp::extract(ini.sections["VERLET"]["domainsY"], domainsY);
+			if (bGPU || domainsX * domainsY > 1)
+			{
+				cout << "Ensemble replicas run on the CPU in one process, set bSimulateOnGPU=0 and domainsX=domainsY=1" << endl;
+				return false;
+			}
+		}
+		// A kernel timed per replica, while the others are already stepping, can come out different
+		// for the same seed, and so does the trajectory since each kernel sums the forces in its own order
+		inipp::Ini<char> replicaIni = ini;
+		replicaIni.sections.erase("ENSEMBLE");
+		int kernel = ForceKernelCells;
+		inipp::extract(replicaIni.sections["VERLET"]["forceKernel"], kernel);
+		if (kernel == ForceKernelAuto)
+		{
+			cout << "Ensemble replicas use the cell force kernel, a timed one could differ between replicas" << endl;
+			replicaIni.sections["VERLET"]["forceKernel"] = std::to_string(int(ForceKernelCells));
+		}
+		replicaConfigFilename = outputPrefix + "_replicas.ini";
+		replicaIni.generate(std::ofstream(replicaConfigFilename));
+		if (bBatched && simulatorType == 0)
+			cout << "Batched replicas leave out pFlux, the Hits and the sampled observables, the columns differ from a scalar run" << endl;
+		if (nReplicas < 1 || nSamples < 1)
+		{
+			cout << "Ensemble needs nReplicas and nSamples above 0" << endl;
+			return false;
+		}
+
+		nThreads = ResolveThreadCount(nThreads);
+		firstSeed = baseSeed != 0 ? unsigned(baseSeed) : std::random_device()();
+		cout << "Ensemble of " << nReplicas << " replicas on " << nThreads << " threads, seeds "
+			<< firstSeed << ".." << firstSeed + nReplicas - 1 << endl;
+
+		replicas.clear();
+		for (int r = 0; r < nReplicas; ++r)
+		{
+			replicas.push_back(std::unique_ptr<Replica>(new Replica));
+			// WriteMean() reads other replicas' rows while they're still adding theirs,
+			// so the rows must never move
+			replicas.back()->samples.reserve(nSamples);
+			replicas.back()->out.open(outputPrefix + "_" + std::to_string(r) + ".txt");
+		}
+		meanOut.open(outputPrefix + "_mean.txt");
+		names.clear();
+		replicasAtSample.assign(nSamples, 0);
+		nextMean = 0;
+		return true;
+	}
+
+	void Run()
+	{
+		if (bBatched && simulatorType == 0)
+		{
+			RunBatched();
+			return;
+		}
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+		for (int r = 0; r < nReplicas; ++r)
+		{
+			// Regions inside a replica are nested and get one thread, size its buffers for that
+			omp_set_num_threads(1);
+			Replica& rep = *replicas[r];
+			rep.sim.reset(CreateSimulator());
+			rep.sim->SetSeed(firstSeed + unsigned(r));
+			rep.sim->SetOutputSuffix("_replica" + std::to_string(r));
+			// Initialize() rewrites the config file. It still runs on this thread,
+			// so the replica's memory is first touched where it is used
+#pragma omp critical(EnsembleConfig)
+			rep.sim->Initialize(replicaConfigFilename);
+			rep.sim->SetSimulate(true);
+
+			// A replica that reached its target error stops, the means end at its last sample
+			while (int(rep.samples.size()) < nSamples && rep.sim->GetSimulate())
+			{
+				rep.sim->Update();
+				++rep.nUpdates;
+				Record(rep, rep.sim->GetStats());
+			}
+			rep.sim->WriteOutputs();
+			rep.sim.reset();
+		}
+	}
+	// Lanes past the last replica of a partial batch run a copy of it and are ignored
+	void RunBatched()
+	{
+		const int nBatches = (nReplicas + BatchLanes - 1) / BatchLanes;
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+		for (int b = 0; b < nBatches; ++b)
+		{
+			const int firstReplica = b * BatchLanes;
+			const int nLanes = (std::min)(BatchLanes, nReplicas - firstReplica);
+			unsigned int seeds[BatchLanes];
+			for (int l = 0; l < BatchLanes; ++l)
+				seeds[l] = firstSeed + unsigned(firstReplica + (std::min)(l, nLanes - 1));
+
+			std::unique_ptr<Batch> batch(new Batch);
+			batch->Initialize(replicaConfigFilename, seeds);
+			for (bool bRunning = true; bRunning;)
+			{
+				batch->Update();
+				bRunning = false;
+				for (int l = 0; l < nLanes; ++l)
+				{
+					Replica& rep = *replicas[firstReplica + l];
+					++rep.nUpdates;
+					Record(rep, batch->GetStats(l));
+					bRunning = bRunning || int(rep.samples.size()) < nSamples;
+				}
+			}
+		}
+	}
+};
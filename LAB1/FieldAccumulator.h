@@ -0,0 +1,150 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "Types.h"
+
+// Density, flow velocity and kinetic temperature on a fixed grid of bins, averaged over the
+// samples between two frames. Each thread bins the particles it kicks into its own copy, the
+// copies are merged once per frame.
+// Frames go to a binary file as they're taken, all little-endian:
+//   header  "VFLD", int32 version, int32 nx, int32 ny, float32 x0, y0, x1, y1
+//   frame   float64 time, int32 samples, then float32 planes of nx * ny bins, x fastest:
+//           density (particles per unit area), vx, vy, T
+// Bins nobody visited have a zero velocity and temperature.
+template<typename real>
+class FieldAccumulator
+{
+	// Per bin: particles, momentum along x and y, and the sum of v^2
+	static const int Channels = 4;
+	static const int32_t Version = 1;
+
+	int nx = 0;
+	int ny = 0;
+	Vector2<real> lo = { 0, 0 };
+	Vector2<real> hi = { 0, 0 };
+	Vector2<real> binScale = { 0, 0 };
+	std::vector<std::vector<double>> threadBins;
+	int nSamples = 0;
+	std::ofstream out;
+	std::vector<float> frame;
+
+public:
+	bool Enabled() const { return nx > 0; }
+	int BinsX() const { return nx; }
+	int BinsY() const { return ny; }
+	int NumValues() const { return nx * ny * Channels; }
+	int NumSamples() const { return nSamples; }
+	double* ThreadBins(int thread) { return threadBins[thread].data(); }
+
+	// binsX 0 turns the fields off
+	void Setup(int nThreads, int binsX, int binsY, const Vector2<real>& from, const Vector2<real>& to)
+	{
+		nx = binsX > 0 && binsY > 0 ? binsX : 0;
+		ny = nx > 0 ? binsY : 0;
+		lo = from;
+		hi = to;
+		binScale = nx > 0 ? Vector2<real>{ nx / (hi.x - lo.x), ny / (hi.y - lo.y) } : Vector2<real>{ 0, 0 };
+		threadBins.assign(nThreads, std::vector<double>(NumValues(), 0.0));
+		nSamples = 0;
+		if (out.is_open())
+			out.close();
+	}
+
+	__forceinline void Add(double* bins, const Vector2<real>& p, const Vector2<real>& v) const
+	{
+		const real fx = (p.x - lo.x) * binScale.x;
+		const real fy = (p.y - lo.y) * binScale.y;
+		if (fx < 0 || fy < 0)
+			return;
+		const int bx = int(fx);
+		const int by = int(fy);
+		if (bx >= nx || by >= ny)
+			return;
+		double* bin = bins + (by * nx + bx) * Channels;
+		bin[0] += 1.0;
+		bin[1] += v.x;
+		bin[2] += v.y;
+		bin[3] += v.SizeSqr();
+	}
+	// One thread, once per sampled pass
+	void AddSample() { ++nSamples; }
+
+	// Sums the threads' bins into merged, NumValues() of them, and clears them
+	void Gather(std::vector<double>& merged, int nThreads)
+	{
+		merged.assign(NumValues(), 0.0);
+		for (int t = 0; t < nThreads; ++t)
+		{
+			std::vector<double>& bins = threadBins[t];
+			for (int k = 0; k < NumValues(); ++k)
+				merged[k] += bins[k];
+			std::fill(bins.begin(), bins.end(), 0.0);
+		}
+	}
+
+	// Truncates the file and writes the header, false if it can't be written
+	bool Open(const std::string& filename)
+	{
+		out.open(filename, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		const int32_t header[] = { Version, nx, ny };
+		const float bounds[] = { float(lo.x), float(lo.y), float(hi.x), float(hi.y) };
+		out.write("VFLD", 4);
+		out.write(reinterpret_cast<const char*>(header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(bounds), sizeof(bounds));
+		out.flush();
+		return bool(out);
+	}
+
+	// The averages over the samples in merged, one value per bin each. Temperature is the kinetic
+	// energy per particle left over after the flow of the bin is taken out, unit masses like the rest
+	void Fields(const std::vector<double>& merged, std::vector<real>& density, std::vector<real>& vx, std::vector<real>& vy, std::vector<real>& T) const
+	{
+		const int nBins = nx * ny;
+		density.assign(nBins, 0);
+		vx.assign(nBins, 0);
+		vy.assign(nBins, 0);
+		T.assign(nBins, 0);
+		if (nSamples == 0)
+			return;
+		const double binArea = double(hi.x - lo.x) * (hi.y - lo.y) / nBins;
+		for (int b = 0; b < nBins; ++b)
+		{
+			const double* bin = merged.data() + b * Channels;
+			const double n = bin[0];
+			density[b] = real(n / (nSamples * binArea));
+			if (n <= 0)
+				continue;
+			const double ux = bin[1] / n;
+			const double uy = bin[2] / n;
+			vx[b] = real(ux);
+			vy[b] = real(uy);
+			T[b] = real((std::max)(0.0, 0.5 * (bin[3] / n - ux * ux - uy * uy)));
+		}
+	}
+
+	// Appends the averages of merged as one frame and starts the next one. Nothing to write to,
+	// or no samples yet, and only the samples are dropped
+	void WriteFrame(const std::vector<double>& merged, double time)
+	{
+		if (out.is_open() && nSamples > 0)
+		{
+			std::vector<real> planes[4];
+			Fields(merged, planes[0], planes[1], planes[2], planes[3]);
+			frame.clear();
+			for (const std::vector<real>& plane : planes)
+				frame.insert(frame.end(), plane.begin(), plane.end());
+			const int32_t samples = nSamples;
+			out.write(reinterpret_cast<const char*>(&time), sizeof(time));
+			out.write(reinterpret_cast<const char*>(&samples), sizeof(samples));
+			out.write(reinterpret_cast<const char*>(frame.data()), frame.size() * sizeof(float));
+			out.flush();
+		}
+		nSamples = 0;
+	}
+};
@@ -1,11 +1,14 @@
 #pragma once
 #include "Types.h"
+#include "StatsRegistry.h"
 #include <string>
+#include <vector>
 #include <map>
 
 template<typename real>
 struct ISimulator 
 {
+	virtual ~ISimulator() {}
 	virtual void Initialize(const std::string& configFilename) abstract;
 	virtual void Update() abstract;
 	virtual void ResetStats() abstract;
@@ -13,10 +16,25 @@ struct ISimulator
 	virtual void SetSimulate(bool newSimulate) abstract;
 	virtual int GetN() const abstract;
 	virtual real GetDt() const abstract;
-	virtual const std::vector<Component<real>>& GetComponents() const abstract;
-	virtual const std::map<std::string, real>& GetStats() const abstract;
+	virtual const ComponentVector<real>& GetComponents() const abstract;
+	virtual const StatsRegistry<real>& GetStatsRegistry() const abstract;
+	// By name, for the thread that calls Update(). Other threads Read() the registry
+	const std::map<std::string, real>& GetStats() const { return GetStatsRegistry().AsMap(); }
+	// Curves rather than single values, like g(r), keyed the same way as the stats
+	virtual const std::map<std::string, std::vector<real>>& GetProfiles() const
+	{
+		static const std::map<std::string, std::vector<real>> none;
+		return none;
+	}
 	virtual Vector2<real> GetDims() const abstract;
 	virtual void SetGPUSimulation(bool newGPUSim) abstract;
 	virtual bool GetGPUSimulation() const abstract;
 	virtual void Draw() {}
+	// Takes effect on the next Initialize(), 0 goes back to the config/random seed
+	virtual void SetSeed(unsigned int newSeed) {}
+	// Goes before the extension of the files the simulator writes, so instances running side by
+	// side don't write over each other. Set it before Initialize()
+	virtual void SetOutputSuffix(const std::string& newSuffix) {}
+	// Writes the profile files now, Update() only does every so often
+	virtual void WriteOutputs() {}
 };
\ No newline at end of file
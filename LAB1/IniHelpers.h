@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <sstream>
 #include "inipp.h"
 
 // Why did you make that function?
@@ -19,4 +21,34 @@ bool InitializeValue(
 	}
 	else
 		return true;
-}
\ No newline at end of file
+}
+// extract() accepts an empty value for strings, so a missing key would never get its default
+inline bool InitializeValue(
+	const std::string& section,
+	const std::string& param,
+	std::string& var, const std::string& def, inipp::Ini<char>& ini)
+{
+	std::string& value = ini.sections[section][param];
+	if (value.empty())
+	{
+		value = def;
+		var = def;
+		return false;
+	}
+	var = value;
+	return true;
+}
+// The items of a comma separated value, spaces and tabs around them cut off, empty ones dropped
+inline std::vector<std::string> SplitList(const std::string& value)
+{
+	std::vector<std::string> items;
+	std::istringstream list(value);
+	std::string item;
+	while (std::getline(list, item, ','))
+	{
+		const size_t first = item.find_first_not_of(" \t");
+		if (first != std::string::npos)
+			items.push_back(item.substr(first, item.find_last_not_of(" \t") - first + 1));
+	}
+	return items;
+}
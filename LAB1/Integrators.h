@@ -0,0 +1,135 @@
+#pragma once
+#include <vector>
+#include <cmath>
+
+enum IntegratorType
+{
+	IntegratorVelocityVerlet = 0,
+	IntegratorPositionVerlet = 1,
+	IntegratorForestRuth = 2,
+	IntegratorOmelyan = 3,
+};
+
+// A step as a chain of kicks (v += k * dt * a) and drifts (p += d * dt * v):
+// kicks[0], drifts[0], kicks[1], ..., drifts[m - 1], kicks[m].
+// Forces are evaluated after a drift only when something needs them, the forces of the
+// last drift are what the next step's first kick uses.
+template<typename real>
+struct SplittingScheme
+{
+	const char* name = "";
+	std::vector<real> kicks;
+	std::vector<real> drifts;
+	// Observables are taken at this kick, with the velocity moved by measureShift * dt * a
+	// to the instant the positions belong to
+	int measureKick = 0;
+	real measureShift = 0;
+
+	int NumDrifts() const { return int(drifts.size()); }
+	bool NeedsForces(int drift) const
+	{
+		const int next = drift + 1;
+		return next == measureKick || kicks[next] != 0 || (next == NumDrifts() && kicks[0] != 0);
+	}
+	int ForceEvaluations() const
+	{
+		int count = 0;
+		for (int s = 0; s < NumDrifts(); ++s)
+			count += NeedsForces(s) ? 1 : 0;
+		return count;
+	}
+};
+
+template<typename real>
+SplittingScheme<real> MakeSplittingScheme(int integrator)
+{
+	SplittingScheme<real> scheme;
+	switch (integrator)
+	{
+	case IntegratorPositionVerlet:
+	{
+		// Half drift, kick, half drift. The second half drift runs into the next step's first one
+		// without forces in between, so the energy is taken at the middle kick like velocity Verlet would
+		scheme.name = "position Verlet";
+		scheme.kicks = { 0, 1, 0 };
+		scheme.drifts = { real(0.5), real(0.5) };
+		scheme.measureKick = 1;
+		scheme.measureShift = real(-0.5);
+		break;
+	}
+	case IntegratorForestRuth:
+	{
+		// 4th order, velocity form, 3 forces per step
+		const double theta = 1.0 / (2.0 - std::cbrt(2.0));
+		scheme.name = "Forest-Ruth";
+		scheme.kicks = { real(0.5 * theta), real(0.5 * (1.0 - theta)), real(0.5 * (1.0 - theta)), real(0.5 * theta) };
+		scheme.drifts = { real(theta), real(1.0 - 2.0 * theta), real(theta) };
+		scheme.measureKick = 3;
+		break;
+	}
+	case IntegratorOmelyan:
+	{
+		// Omelyan, Mryglod and Folk, optimized 4th order velocity form, 4 forces per step
+		// but a much smaller error constant than Forest-Ruth
+		const double xi = 0.1644986515575760;
+		const double lambda = -0.02094333910398989;
+		const double chi = 1.235692651138917;
+		scheme.name = "Omelyan";
+		scheme.kicks = { real(xi), real(chi), real(1.0 - 2.0 * (chi + xi)), real(chi), real(xi) };
+		scheme.drifts = { real(0.5 * (1.0 - 2.0 * lambda)), real(lambda), real(lambda), real(0.5 * (1.0 - 2.0 * lambda)) };
+		scheme.measureKick = 4;
+		break;
+	}
+	default:
+	{
+		scheme.name = "velocity Verlet";
+		scheme.kicks = { real(0.5), real(0.5) };
+		scheme.drifts = { 1 };
+		scheme.measureKick = 1;
+		break;
+	}
+	}
+	return scheme;
+}
+
+// Which part of the pair force an Accel() pass computes. r-RESPA gives the near part to
+// the inner steps and evaluates the far part once per respaSteps of them
+enum ForceRange
+{
+	ForcesAll = 0,
+	ForcesNear = 1,
+	ForcesFar = 2,
+};
+
+// How the full-range force passes find their pairs. RESPA near passes always go over cells
+enum ForceKernel
+{
+	// Timed at Initialize(), the fastest one for this N and density is kept
+	ForceKernelAuto = -1,
+	ForceKernelCells = 0,
+	// Index-ordered tiles of ForceTileSize particles against each other, no binning at all
+	ForceKernelAllPairs = 1,
+	// Pairs within cutoffRadius + neighbourSkin, kept until a particle has moved half the skin
+	ForceKernelNeighbourList = 2,
+};
+
+// 1 below inner, 0 above outer and a smoothstep in between, dS is its derivative in r.
+// The near potential is S * U, so both parts stay conservative
+template<typename real>
+real RespaSwitch(real r, real inner, real outer, real& dS)
+{
+	if (r <= inner)
+	{
+		dS = 0;
+		return 1;
+	}
+	if (r >= outer)
+	{
+		dS = 0;
+		return 0;
+	}
+	const real width = outer - inner;
+	const real x = (r - inner) / width;
+	dS = real(-6.0) * x * (real(1.0) - x) / width;
+	return real(1.0) - x * x * (real(3.0) - real(2.0) * x);
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <memory>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <iostream>
+#include <type_traits>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#define PSAPI_VERSION 2
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum HugePageMode
+{
+	HugePagesOff = 0,
+	HugePagesTransparent = 1,
+	HugePagesExplicit = 2,
+};
+
+inline size_t HugePageSize()
+{
+#ifdef _WIN32
+	size_t size = GetLargePageMinimum();
+	return size != 0 ? size : (size_t(2) << 20);
+#else
+	return size_t(2) << 20;
+#endif
+}
+
+// Explicit huge page requests are rounded up to whole huge pages, fallback included,
+// so that FreePages can release the same length
+inline size_t PagesLength(size_t bytes, int hugePages)
+{
+	if (hugePages != HugePagesExplicit)
+		return bytes;
+	size_t large = HugePageSize();
+	return (bytes + large - 1) / large * large;
+}
+
+// Page-granular memory straight from the OS. Nothing is written here, so pages land on
+// the NUMA node of whichever thread touches them first.
+inline void* AllocatePages(size_t bytes, int hugePages)
+{
+	static bool bWarnedExplicit = false;
+	bytes = PagesLength(bytes, hugePages);
+#ifdef _WIN32
+	if (hugePages == HugePagesExplicit)
+	{
+		void* p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (p)
+			return p;
+		if (!bWarnedExplicit)
+			std::cout << "Large pages unavailable (needs SeLockMemoryPrivilege), using regular pages" << std::endl;
+		bWarnedExplicit = true;
+	}
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	if (hugePages == HugePagesExplicit)
+	{
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			return p;
+		if (!bWarnedExplicit)
+			std::cout << "No hugetlbfs pages reserved, using regular pages" << std::endl;
+		bWarnedExplicit = true;
+	}
+	void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return nullptr;
+	if (hugePages == HugePagesTransparent)
+		madvise(p, bytes, MADV_HUGEPAGE);
+	return p;
+#endif
+}
+inline void FreePages(void* p, size_t bytes, int hugePages)
+{
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, PagesLength(bytes, hugePages));
+#endif
+}
+
+// Below this an allocation isn't worth pages of its own, a huge page with hugePages on
+inline size_t MinPagedBytes(int hugePages)
+{
+	return hugePages != HugePagesOff ? HugePageSize() : size_t(64) << 10;
+}
+
+// std::vector allocator on top of AllocatePages for the per-particle arrays. Default construction
+// leaves elements uninitialised, so vector(n) doesn't touch memory and FirstTouch() decides placement.
+// Anything smaller than MinPagedBytes() comes from std::allocator instead, deallocate() gets the
+// same n and makes the same choice
+template<typename T>
+struct PageAllocator
+{
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	int hugePages = HugePagesOff;
+
+	PageAllocator() {}
+	explicit PageAllocator(int newHugePages) : hugePages(newHugePages) {}
+	template<typename U>
+	PageAllocator(const PageAllocator<U>& other) : hugePages(other.hugePages) {}
+
+	T* allocate(size_t n)
+	{
+		if (n == 0)
+			return nullptr;
+		if (n * sizeof(T) < MinPagedBytes(hugePages))
+			return std::allocator<T>().allocate(n);
+		void* p = AllocatePages(n * sizeof(T), hugePages);
+		if (!p)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+	void deallocate(T* p, size_t n)
+	{
+		if (!p)
+			return;
+		if (n * sizeof(T) < MinPagedBytes(hugePages))
+			std::allocator<T>().deallocate(p, n);
+		else
+			FreePages(p, n * sizeof(T), hugePages);
+	}
+
+	template<typename U>
+	void construct(U* p) { ::new((void*)p) U; }
+	template<typename U, typename... Args>
+	void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+
+	template<typename U>
+	bool operator==(const PageAllocator<U>& other) const { return hugePages == other.hugePages; }
+	template<typename U>
+	bool operator!=(const PageAllocator<U>& other) const { return hugePages != other.hugePages; }
+};
+
+template<typename T>
+using PageVector = std::vector<T, PageAllocator<T>>;
+
+// Writes every element with the same static split the kicks, drifts and observables use,
+// so each thread's share of the array is placed on that thread's node. The force passes don't
+// follow that split: their cell tasks go to whichever thread the work-stealing scheduler hands
+// them to, so a force task reads particles from wherever they landed. Small arrays that
+// didn't get pages of their own aren't placed at all
+template<typename T>
+void FirstTouch(PageVector<T>& v, int nThreads)
+{
+	const int n = int(v.size());
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+	for (int i = 0; i < n; ++i)
+		v[i] = T();
+}
+
+// Resident pages of a range per NUMA node, -1 collects pages the OS couldn't place
+inline std::map<int, size_t> PagePlacement(const void* data, size_t bytes)
+{
+	std::map<int, size_t> nodes;
+	if (!data || bytes == 0)
+		return nodes;
+#ifdef _WIN32
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	const size_t pageSize = sysInfo.dwPageSize;
+#else
+	const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+#endif
+	const char* first = (const char*)(size_t(data) / pageSize * pageSize);
+	const size_t nPages = (size_t((const char*)data + bytes - first) + pageSize - 1) / pageSize;
+#ifdef _WIN32
+	std::vector<PSAPI_WORKING_SET_EX_INFORMATION> info(nPages);
+	for (size_t i = 0; i < nPages; ++i)
+		info[i].VirtualAddress = (PVOID)(first + i * pageSize);
+	if (!QueryWorkingSetEx(GetCurrentProcess(), info.data(), DWORD(nPages * sizeof(info[0]))))
+	{
+		nodes[-1] = nPages;
+		return nodes;
+	}
+	for (size_t i = 0; i < nPages; ++i)
+		++nodes[info[i].VirtualAttributes.Valid ? int(info[i].VirtualAttributes.Node) : -1];
+#else
+	std::vector<void*> pages(nPages);
+	std::vector<int> status(nPages, -1);
+	for (size_t i = 0; i < nPages; ++i)
+		pages[i] = (void*)(first + i * pageSize);
+	// move_pages with no target nodes only reports where pages are
+	if (syscall(SYS_move_pages, 0, (unsigned long)nPages, pages.data(), nullptr, status.data(), 0) != 0)
+	{
+		nodes[-1] = nPages;
+		return nodes;
+	}
+	for (size_t i = 0; i < nPages; ++i)
+		++nodes[status[i] >= 0 ? status[i] : -1];
+#endif
+	return nodes;
+}
+// One line per logical array, which may be spread over several allocations
+inline void ReportPlacement(const std::string& name, const std::vector<std::pair<const void*, size_t>>& ranges)
+{
+	std::map<int, size_t> nodes;
+	size_t bytes = 0;
+	for (auto& range : ranges)
+	{
+		bytes += range.second;
+		for (auto& node : PagePlacement(range.first, range.second))
+			nodes[node.first] += node.second;
+	}
+	std::cout << name << ": " << bytes / 1024 << " KB";
+	for (auto& node : nodes)
+	{
+		if (node.first < 0)
+			std::cout << ", unplaced " << node.second;
+		else
+			std::cout << ", node " << node.first << ": " << node.second;
+	}
+	std::cout << " pages" << std::endl;
+}
+inline void ReportPlacement(const std::string& name, const void* data, size_t bytes)
+{
+	ReportPlacement(name, { std::make_pair(data, bytes) });
+}
@@ -0,0 +1,166 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "Types.h"
+#include "MemoryHelpers.h"
+
+// Multiple-tau correlator (Ramirez et al. 2010) for the mean-squared displacement and the
+// velocity autocorrelation. Level l holds the last nPoints samples taken every 2^l samples,
+// so lags up to nPoints * 2^(nLevels - 1) cost nPoints * nLevels entries per particle.
+// Positions going up a level are the latest of the block, the displacement at a lag stays
+// exact. Velocities are averaged over the block, which is what a coarser sampling of a
+// smoother signal sees.
+// Begin() is called by one thread per sample, then Push() for every particle by whichever
+// thread owns it, each thread adds into its own sums.
+template<typename real>
+class MultipleTauCorrelator
+{
+	static const int BlockLength = 2;
+
+	int nParticles = 0;
+	int nPoints = 0;
+	int nLevels = 0;
+	// Levels the current sample goes into, and where it goes in each
+	int nPushLevels = 0;
+	std::vector<int> heads;
+	std::vector<int> filled;
+	std::vector<long long> pushes;
+	// Time of every entry, the same for all particles
+	std::vector<double> times;
+
+	// Per particle and level, nPoints entries each
+	PageVector<Vector2<double>> positions;
+	PageVector<Vector2<double>> velocities;
+
+	// Sums over particles per slot (level * nPoints + lag), per thread until Gather()
+	std::vector<std::vector<double>> threadSums;
+	std::vector<double> msd;
+	std::vector<double> vacf;
+	std::vector<double> contributions;
+	std::vector<double> lagTimes;
+	std::vector<double> lagSamples;
+
+	int Slot(int level, int lag) const { return level * nPoints + lag; }
+	size_t Entry(int particle, int level, int index) const
+	{
+		return (size_t(particle) * nLevels + level) * nPoints + index;
+	}
+	// Lags below nPoints / BlockLength are covered more finely by the level below
+	int FirstLag(int level) const { return level == 0 ? 0 : nPoints / BlockLength; }
+
+public:
+	bool Enabled() const { return nPoints > 0; }
+
+	void Setup(int particles, int nThreads, int points, int levels, int hugePages)
+	{
+		nParticles = particles;
+		nPoints = (std::max)(0, points);
+		// Levels above 0 only add lags from nPoints / 2 up
+		if (nPoints > 0)
+			nPoints = (std::max)(nPoints, 2 * BlockLength);
+		nLevels = nPoints > 0 ? (std::max)(1, levels) : 0;
+		const int nSlots = nLevels * nPoints;
+		heads.assign(nLevels, nPoints - 1);
+		filled.assign(nLevels, 0);
+		pushes.assign(nLevels, 0);
+		times.assign(nSlots, 0.0);
+		nPushLevels = 0;
+
+		const size_t nEntries = size_t(nParticles) * nSlots;
+		positions = PageVector<Vector2<double>>(nEntries, PageAllocator<Vector2<double>>(hugePages));
+		velocities = PageVector<Vector2<double>>(nEntries, PageAllocator<Vector2<double>>(hugePages));
+		FirstTouch(positions, nThreads);
+		FirstTouch(velocities, nThreads);
+
+		threadSums.assign(nThreads, std::vector<double>(2 * nSlots, 0.0));
+		msd.assign(nSlots, 0.0);
+		vacf.assign(nSlots, 0.0);
+		contributions.assign(nSlots, 0.0);
+		lagTimes.assign(nSlots, 0.0);
+		lagSamples.assign(nSlots, 0.0);
+	}
+
+	// One thread, before the particles of a sample are pushed. n of them will be
+	void Begin(double time, int n)
+	{
+		nPushLevels = 0;
+		for (int level = 0; level < nLevels; ++level)
+		{
+			// A level takes every BlockLength-th push of the one below
+			if (level > 0 && pushes[level - 1] % BlockLength != 0)
+				break;
+			++nPushLevels;
+			++pushes[level];
+			heads[level] = (heads[level] + 1) % nPoints;
+			filled[level] = (std::min)(filled[level] + 1, nPoints);
+			times[Slot(level, heads[level])] = time;
+			for (int lag = FirstLag(level); lag < filled[level]; ++lag)
+			{
+				const int index = (heads[level] - lag + nPoints) % nPoints;
+				contributions[Slot(level, lag)] += n;
+				lagTimes[Slot(level, lag)] += time - times[Slot(level, index)];
+				lagSamples[Slot(level, lag)] += 1;
+			}
+		}
+	}
+	// particle is a stable index, not where the particle sits in the arrays right now
+	void Push(int thread, int particle, const Vector2<double>& position, const Vector2<double>& velocity)
+	{
+		double* sums = threadSums[thread].data();
+		const int nSlots = nLevels * nPoints;
+		Vector2<double> v = velocity;
+		for (int level = 0; level < nPushLevels; ++level)
+		{
+			const int head = heads[level];
+			const size_t base = Entry(particle, level, 0);
+			positions[base + head] = position;
+			velocities[base + head] = v;
+			for (int lag = FirstLag(level); lag < filled[level]; ++lag)
+			{
+				const int index = (head - lag + nPoints) % nPoints;
+				const Vector2<double> d = position - positions[base + index];
+				sums[Slot(level, lag)] += d.SizeSqr();
+				sums[nSlots + Slot(level, lag)] += v * velocities[base + index];
+			}
+			if (level + 1 == nPushLevels)
+				break;
+			// Block average of what this level got since its last push upwards
+			Vector2<double> block = { 0.0, 0.0 };
+			for (int b = 0; b < BlockLength; ++b)
+				block += velocities[base + (head - b + nPoints) % nPoints];
+			v = block / double(BlockLength);
+		}
+	}
+	void Gather(int nThreads)
+	{
+		const int nSlots = nLevels * nPoints;
+		for (int t = 0; t < nThreads; ++t)
+		{
+			std::vector<double>& sums = threadSums[t];
+			for (int s = 0; s < nSlots; ++s)
+			{
+				msd[s] += sums[s];
+				vacf[s] += sums[nSlots + s];
+			}
+			std::fill(sums.begin(), sums.end(), 0.0);
+		}
+	}
+
+	// Every lag seen so far, in increasing order
+	void Results(std::vector<real>& lag, std::vector<real>& outMsd, std::vector<real>& outVacf) const
+	{
+		lag.clear();
+		outMsd.clear();
+		outVacf.clear();
+		for (int level = 0; level < nLevels; ++level)
+			for (int l = FirstLag(level); l < nPoints; ++l)
+			{
+				const int s = Slot(level, l);
+				if (contributions[s] <= 0)
+					continue;
+				lag.push_back(real(lagTimes[s] / lagSamples[s]));
+				outMsd.push_back(real(msd[s] / contributions[s]));
+				outVacf.push_back(real(vacf[s] / contributions[s]));
+			}
+	}
+};
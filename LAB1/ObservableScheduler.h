@@ -0,0 +1,137 @@
+#pragma once
+#include <iostream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// How an observable gets at the particles
+enum ObservableCost
+{
+	// Rides along a pass the step makes anyway, the kicks or the force pass
+	ObservableFused = 0,
+	// Needs a pass of its own inside the step
+	ObservablePass = 1,
+	// Copies what it needs at the sample, the work runs next to the steps that follow
+	ObservableSnapshot = 2,
+};
+
+// Every observable a simulator can take, with the stride it's taken at. Strides are fixed
+// between Initialize() calls, so whether one is due is a function of the step alone and every
+// thread of a region comes to the same answer without talking to the others.
+// Snapshot work is handed to Defer() and has to be collected with Join() before its results are read.
+// It runs in order on one worker thread, started with the first snapshot and kept until the
+// scheduler goes away, so a sample costs a queue push instead of a thread of its own.
+class ObservableScheduler
+{
+	struct Entry
+	{
+		std::string name;
+		int stride = 0;
+		int cost = ObservableFused;
+	};
+	std::vector<Entry> entries;
+
+	std::thread worker;
+	std::mutex lock;
+	// Signals new work or a stop to the worker, and a finished item to whoever waits on it
+	std::condition_variable wake;
+	std::condition_variable done;
+	std::deque<std::function<void()>> queued;
+	// Queued plus the one running
+	int nPending = 0;
+	bool bStop = false;
+
+	void Work()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		for (;;)
+		{
+			wake.wait(guard, [this]() { return bStop || !queued.empty(); });
+			if (queued.empty())
+				return;
+			std::function<void()> work = std::move(queued.front());
+			queued.pop_front();
+			guard.unlock();
+			work();
+			guard.lock();
+			--nPending;
+			done.notify_all();
+		}
+	}
+
+public:
+	// More snapshots than this in flight and the step waits for the oldest one
+	static const int MaxPending = 4;
+
+	~ObservableScheduler()
+	{
+		if (!worker.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			bStop = true;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	void Clear()
+	{
+		Join();
+		entries.clear();
+	}
+	// stride 0 or less leaves the observable off, the id still works with Due()
+	int Register(const std::string& name, int stride, int cost)
+	{
+		Entry entry;
+		entry.name = name;
+		entry.stride = (std::max)(0, stride);
+		entry.cost = cost;
+		entries.push_back(entry);
+		return int(entries.size()) - 1;
+	}
+	bool Enabled(int id) const { return entries[id].stride > 0; }
+	bool Due(int id, long long step) const
+	{
+		const int stride = entries[id].stride;
+		return stride > 0 && step % stride == 0;
+	}
+
+	void Defer(std::function<void()> work)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			if (!worker.joinable())
+				worker = std::thread(&ObservableScheduler::Work, this);
+			done.wait(guard, [this]() { return nPending < MaxPending; });
+			queued.push_back(std::move(work));
+			++nPending;
+		}
+		wake.notify_one();
+	}
+	void Join()
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [this]() { return nPending == 0; });
+	}
+
+	void Report() const
+	{
+		const char* costs[] = { "fused", "own pass", "snapshot" };
+		std::cout << "Observables:";
+		bool bAny = false;
+		for (const Entry& entry : entries)
+		{
+			if (entry.stride <= 0)
+				continue;
+			std::cout << (bAny ? ", " : " ") << entry.name << " every " << entry.stride << " (" << costs[entry.cost] << ")";
+			bAny = true;
+		}
+		std::cout << (bAny ? "" : " none") << std::endl;
+	}
+};
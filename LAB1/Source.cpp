@@ -22,6 +22,9 @@ sf::Font font;
 sf::Text infoText;
 float compExecTimeMS = 0;
 float rendExecTimeMS = 0;
+string statsString;
+vector<real> statsValues;
+unsigned int statsVersion = ~0u;
 
 unique_ptr<ISimulator<real>> sim;
 sf::RenderWindow sfmlWnd;
@@ -69,7 +72,7 @@ void Results(sf::RenderWindow& wnd)
 	sf::Transform rot2 = sf::Transform::Identity;
 	rot2.rotate(2 * 360 / 3);
 
-	const vector<Component<real>>& comps = sim->GetComponents();
+	const ComponentVector<real>& comps = sim->GetComponents();
 
 	sf::Vector2f screenSizeHalf(sfmlWnd.getSize().x / 2.0f, sfmlWnd.getSize().y / 2.0f);
 	for (int i = 0; i < N; ++i)
@@ -94,13 +97,17 @@ void Results(sf::RenderWindow& wnd)
 		triangles[i * 3 + 2].color = theColor;
 	}
 
-	string infoString = "";
-	const map<string, real>& stats = sim->GetStats();
-	for(auto& pair : stats)
-		infoString += pair.first + ": " + to_string(pair.second) + "\r\n";
-
+	// Only formatted again when the simulator published new stats
+	const StatsRegistry<real>& stats = sim->GetStatsRegistry();
+	if (stats.Version() != statsVersion || stats.Size() != int(statsValues.size()))
+	{
+		statsVersion = stats.Read(statsValues);
+		statsString = "";
+		for (size_t i = 0; i < statsValues.size(); ++i)
+			statsString += stats.Name(int(i)) + ": " + to_string(statsValues[i]) + "\r\n";
+	}
 
-	infoText.setString(infoString +
+	infoText.setString(statsString +
 		"dT: " + to_string(dt) + "\r\n" +
 		"comp time: " + to_string(compExecTimeMS) + "\r\n" +
 		"rend time: " + to_string(rendExecTimeMS));
@@ -0,0 +1,43 @@
+#include <GL/glew.h>
+#include "VerletSimulator.h"
+#include <chrono>
+#include <cstdlib>
+#include <GL/glut.h>
+
+using namespace std;
+
+typedef float real;
+typedef Vector2<real> Vector2r;
+
+// Headless entry point for one rank of a decomposed run. Start domainsX * domainsY of these with
+// VERLET_RANK = 0, 1, .. set, they connect to each other and simulate from the start.
+// Every rank runs the same number of updates, the collectives would wait forever otherwise
+int main(int argc, char ** argv)
+{
+	const string configFilename = argc > 1 ? argv[1] : "Config.ini";
+	const int nUpdates = argc > 2 ? atoi(argv[2]) : 1000;
+	const int rank = RankFromEnvironment();
+
+	VerletSimulator<real> sim;
+	sim.Initialize(configFilename);
+	sim.SetSimulate(true);
+
+	auto start = chrono::steady_clock::now();
+	int update = 0;
+	for (; update < nUpdates && sim.GetSimulate(); ++update)
+	{
+		sim.Update();
+		// The stats are summed over the ranks already, one of them is enough
+		if (rank != 0 || (update + 1) % 100 != 0)
+			continue;
+		cout << "Update " << update + 1;
+		for (auto& stat : sim.GetStats())
+			cout << ", " << stat.first << ": " << stat.second;
+		cout << endl;
+	}
+	sim.WriteOutputs();
+	if (rank == 0)
+		cout << update << " updates in "
+			<< chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() / 1000.0 << " s" << endl;
+	return 0;
+}
@@ -54,6 +54,7 @@ void GlutIdleFunc()
 
 		cout << "Simulation Stats:" << endl;
 		cout << infoString << endl;
+		sim->WriteOutputs();
 
 		flagStat = 0;
 	}
@@ -0,0 +1,23 @@
+#include <GL/glew.h>
+#include "SweepRunner.h"
+#include <chrono>
+#include <GL/glut.h>
+
+using namespace std;
+
+typedef float real;
+typedef Vector2<real> Vector2r;
+
+// Headless entry point, runs the [SWEEP] section of the config and exits
+int main(int argc, char ** argv)
+{
+	SweepRunner<real> runner;
+	if (!runner.Initialize(argc > 1 ? argv[1] : "Config.ini"))
+		return 1;
+
+	auto start = chrono::steady_clock::now();
+	runner.Run();
+	cout << "Sweep finished in "
+		<< chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() / 1000.0 << " s" << endl;
+	return 0;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <thread>
+
+// Single values a simulator reports, in fixed slots. Each name is registered once and the
+// handle that comes back is what the simulator writes through from then on, names are only
+// read back for display and export.
+// The thread that simulates Set()s the slots and makes them visible with Publish(). Any other
+// thread copies them with Read(), a seqlock: a copy that overlapped a Publish() is taken again,
+// so neither side ever waits for the other.
+// Clear() and Register() belong to Initialize(), nobody may be reading while they run.
+template<typename real>
+class StatsRegistry
+{
+public:
+	static const int MaxStats = 128;
+
+private:
+	std::string names[MaxStats];
+	// What the simulator is writing, and what readers see. One spare slot for names past MaxStats
+	real values[MaxStats + 1];
+	std::atomic<real> published[MaxStats];
+	std::atomic<int> count{ 0 };
+	// Odd while a Publish() is running
+	std::atomic<unsigned> sequence{ 0 };
+
+	mutable std::map<std::string, real> byName;
+	mutable unsigned byNameSequence = 1;
+
+public:
+	void Clear()
+	{
+		count.store(0, std::memory_order_relaxed);
+		byName.clear();
+		byNameSequence = 1;
+	}
+	// The same name gets the same handle. A value is NaN until it's first set
+	int Register(const std::string& name)
+	{
+		const int n = count.load(std::memory_order_relaxed);
+		for (int i = 0; i < n; ++i)
+			if (names[i] == name)
+				return i;
+		// Written to but never shown
+		if (n == MaxStats)
+			return MaxStats;
+		names[n] = name;
+		values[n] = std::numeric_limits<real>::quiet_NaN();
+		published[n].store(values[n], std::memory_order_relaxed);
+		count.store(n + 1, std::memory_order_release);
+		return n;
+	}
+	// -1 if there's no such stat
+	int Find(const std::string& name) const
+	{
+		const int n = Size();
+		for (int i = 0; i < n; ++i)
+			if (names[i] == name)
+				return i;
+		return -1;
+	}
+	int Size() const { return count.load(std::memory_order_acquire); }
+	const std::string& Name(int handle) const { return names[handle]; }
+
+	// Simulating thread only
+	void Set(int handle, real value) { values[handle] = value; }
+	real Get(int handle) const { return values[handle]; }
+	void Publish()
+	{
+		const unsigned s = sequence.load(std::memory_order_relaxed);
+		sequence.store(s + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		const int n = Size();
+		for (int i = 0; i < n; ++i)
+			published[i].store(values[i], std::memory_order_relaxed);
+		sequence.store(s + 2, std::memory_order_release);
+	}
+
+	// Goes up by one with every Publish(), a reader that saw this one already has nothing new to read
+	unsigned Version() const { return sequence.load(std::memory_order_acquire) / 2; }
+	// Any thread. The values of the last Publish(), one per handle, and the version they belong to
+	unsigned Read(std::vector<real>& out) const
+	{
+		for (;;)
+		{
+			const unsigned before = sequence.load(std::memory_order_acquire);
+			if (before & 1)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			out.resize(Size());
+			for (size_t i = 0; i < out.size(); ++i)
+				out[i] = published[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == before)
+				return before / 2;
+		}
+	}
+
+	// Name -> value of the last Publish(), built again only when there's been one since.
+	// Simulating thread only, for the code that exports by name
+	const std::map<std::string, real>& AsMap() const
+	{
+		const unsigned s = sequence.load(std::memory_order_relaxed);
+		if (s != byNameSequence)
+		{
+			const int n = Size();
+			for (int i = 0; i < n; ++i)
+				byName[names[i]] = published[i].load(std::memory_order_relaxed);
+			byNameSequence = s;
+		}
+		return byName;
+	}
+};
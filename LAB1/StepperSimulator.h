@@ -7,10 +7,15 @@
 #include <fstream>
 #include <filesystem>
 #include <map>
+#include <queue>
+#include <functional>
 #include "ISimulator.h"
 #include "Types.h"
 #include "inipp.h"
 #include "IniHelpers.h"
+#include "ThreadHelpers.h"
+#include "CellGrid.h"
+#include "ContactGraph.h"
 
 template<typename real>
 struct StepperProperties
@@ -23,9 +28,16 @@ struct StepperProperties
 	real particleRadius;
 	real particleMass;
 	real maxRandV;
+	// Iterations of the depenetration solver per step, it stops early once no overlap
+	// is deeper than depenetrationTolerance particle radii
 	int depenetrationSteps;
 	real depenetrationBonus = 0.000001;
+	real depenetrationTolerance = 0.01;
 	real ATSMultiplier = 0.9;
+	// Swept collisions inside the step: the adaptive dt follows the RMS speed instead of the
+	// fastest particle, and the pairs that would meet within the step are stepped to their time of impact
+	int bContinuousCollisions = false;
+	int nThreads = 0;
 
 	int doubleCollisions = 0;
 	int tripleCollisions = 0;
@@ -33,11 +45,18 @@ struct StepperProperties
 	int doubleCollisionsMax = 0;
 	int tripleCollisionsMax = 0;
 	int quadCollisionsMax = 0;
+	// Most solver iterations a step of this update took, and the deepest overlap one left behind
+	int depenetrationIterations = 0;
+	real depenetrationResidual = 0;
+	int sweptCollisions = 0;
 
 	int nAvg;
 	int bUseAdaptiveTimeStep = true;
 	bool bSimulate = false;
 	int bGPUSim = false;
+
+	real _time = 0;
+	unsigned int seed = 0;
 };
 
 template<typename real>
@@ -48,12 +67,50 @@ struct CollisionInfo
 	Vector2<real> impactNormal;
 };
 
+// A pair (other >= 0) or wall (other = -1 - wall) meeting at time t of the current step.
+// Stale once either side collided after it was predicted
+template<typename real>
+struct ImpactEvent
+{
+	real t;
+	int i;
+	int other;
+	int countI;
+	int countOther;
+
+	bool operator > (const ImpactEvent<real>& e) const
+	{
+		if (t != e.t) return t > e.t;
+		if (i != e.i) return i > e.i;
+		return other > e.other;
+	}
+};
+
 template<typename real>
 class StepperSimulator : private StepperProperties<real>, virtual public ISimulator<real> 
 {
-	std::vector<Component<real>> components0;
-	std::vector<Component<real>> components;
-	std::map<std::string, real> stats;
+	ComponentVector<real> components0;
+	ComponentVector<real> components;
+	StatsRegistry<real> stats;
+	struct StatHandles
+	{
+		int E, I, colDoubles, colTriples, colQuadruples, time, swept, depenIterations, depenResidual;
+	} handles = {};
+
+	// Broadphase: pairs come from the cells around each particle instead of a scan over all N
+	CellGrid<real> grid;
+	std::vector<std::vector<std::pair<int, int>>> cellPairs;
+	std::vector<std::pair<int, int>> pairs;
+	// Touching pairs, rebuilt by Interact() and by every iteration of Depenetrate()
+	ContactGraph contacts;
+	ThreadPartials<real> threadMaxOverlap;
+	// Continuous collisions: pairs that may meet within the step, the time inside the step every
+	// particle's position belongs to, and how many collisions it had so far
+	ContactGraph swept;
+	std::vector<real> sweptTime;
+	std::vector<int> sweptCount;
+	std::vector<std::vector<ImpactEvent<real>>> threadEvents;
+	std::priority_queue<ImpactEvent<real>, std::vector<ImpactEvent<real>>, std::greater<ImpactEvent<real>>> events;
 
 	void InitializeConfig(const std::string& configFilename) 
 	{
@@ -86,39 +143,89 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 		InitializeValue("STEPPER", "maxRandV", maxRandV, real(1.0), ini);
 		InitializeValue("STEPPER", "depenetrationSteps", depenetrationSteps, 5, ini);
 		InitializeValue("STEPPER", "depenetrationBonus", depenetrationBonus, real(0.000001), ini);
+		InitializeValue("STEPPER", "depenetrationTolerance", depenetrationTolerance, real(0.01), ini);
 		InitializeValue("STEPPER", "ATSMultiplier", ATSMultiplier, real(0.9), ini);
+		InitializeValue("STEPPER", "bContinuousCollisions", bContinuousCollisions, 0, ini);
+		InitializeValue("STEPPER", "nThreads", nThreads, 0, ini);
 
 		ini.generate(std::ofstream(configFilename));
+		nThreads = ResolveThreadCount(nThreads);
+		grid.SetupNeighbourhood(Vector2<real>{ Lx, Ly }, bContinuousCollisions ? SweptRadius() : ContactRadius(), false, false);
+		cellPairs.assign(grid.NumCells(), std::vector<std::pair<int, int>>());
+		threadMaxOverlap.Resize(nThreads);
 	}
 	void GenerateParticles()
 	{
 		std::uniform_real_distribution<real> rand(real(0.0), real(1.0));
 		std::uniform_real_distribution<real> randdual(real(-1.0), real(1.0));
 		std::random_device rdev;
-		components0 = components = std::vector<Component<real>>(N);
+		std::mt19937 rng(seed != 0 ? seed : rdev());
+		components0 = components = ComponentVector<real>(N);
 
 		for (int i = 0; i < N; ++i)
 		{
 			Component<real> newComp; 
-			newComp.p = { rand(rdev) * Lx * 0.5, rand(rdev) * Ly * 0.5 };
-			newComp.v = { randdual(rdev) * maxRandV, randdual(rdev) * maxRandV };
+			newComp.p = { rand(rng) * Lx * 0.5, rand(rng) * Ly * 0.5 };
+			newComp.v = { randdual(rng) * maxRandV, randdual(rng) * maxRandV };
 			newComp.a = { 0, 0 };
 
 			components[i] = components0[i] = newComp;
 		}
 	}
 
-	bool FindAllCollisionsWith(std::vector<CollisionInfo<real>>& outInfo, Component<real>* collider, std::vector<Component<real>>& comps, bool bClearVector = true)
+	// Centre distance at which two particles touch
+	real ContactRadius() const { return sqrt(particleRadius * particleRadius * 2); }
+	// Particles moving under a radius per step are slow. Two slow ones can only meet
+	// within the step if they start this close
+	real SweptRadius() const { return ContactRadius() + 2 * particleRadius; }
+
+	// Pairs closer than radius. Cells are scanned in parallel and their pairs joined in cell order,
+	// so the graph doesn't depend on the number of threads
+	void FindPairs(const ComponentVector<real>& comps, real radius, ContactGraph& graph)
+	{
+		GatherPairs(comps, radius);
+		graph.Build(pairs, N);
+	}
+	void GatherPairs(const ComponentVector<real>& comps, real radius)
+	{
+		grid.Build(comps, N);
+		const real radiusSqr = radius * radius;
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 16)
+		for (int cell = 0; cell < grid.NumCells(); ++cell)
+		{
+			std::vector<std::pair<int, int>>& list = cellPairs[cell];
+			list.clear();
+			for (int k = grid.partnerStart[cell]; k < grid.partnerStart[cell + 1]; ++k)
+			{
+				const int other = grid.partners[k];
+				for (int a = grid.cellStart[cell]; a < grid.cellStart[cell + 1]; ++a)
+				{
+					const int i = grid.items[a];
+					for (int b = (other == cell) ? a + 1 : grid.cellStart[other]; b < grid.cellStart[other + 1]; ++b)
+					{
+						const int j = grid.items[b];
+						Vector2<real> d = comps[j].p - comps[i].p;
+						if (d.SizeSqr() <= radiusSqr)
+							list.push_back(std::make_pair(i, j));
+					}
+				}
+			}
+		}
+		pairs.clear();
+		for (const std::vector<std::pair<int, int>>& list : cellPairs)
+			pairs.insert(pairs.end(), list.begin(), list.end());
+	}
+	// Contacts of particle i with the neighbours graph gives it, walls last
+	bool FindAllCollisionsWith(std::vector<CollisionInfo<real>>& outInfo, int i, ComponentVector<real>& comps, const ContactGraph& graph)
 	{
 		const real doubleRadiusSqr = particleRadius * particleRadius * 2;
-		bool bCollisionFound = false;
-
-		if (bClearVector) outInfo.clear();
+		Component<real>* collider = &comps[i];
+		outInfo.clear();
 
-		for (int i = 0; i < N; ++i) if (&comps[i] != collider)
+		for (int k = graph.start[i]; k < graph.start[i + 1]; ++k)
 		{
 			CollisionInfo<real> newCollision;
-			Component<real>* other = &comps[i];
+			Component<real>* other = &comps[graph.neighbours[k]];
 			Vector2<real> d = other->p - collider->p;
 
 			if (d.SizeSqr() > doubleRadiusSqr)
@@ -129,8 +236,6 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 			newCollision.impactNormal = d.Normalized();
 
 			outInfo.push_back(newCollision);
-
-			bCollisionFound = true;
 		}
 
 		if (!xWrap) 
@@ -143,8 +248,6 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 				newCollision.impactNormal = Vector2<real>{ -1, 0 };
 
 				outInfo.push_back(newCollision);
-
-				bCollisionFound = true;
 			}
 			else if (collider->p.x + particleRadius > Lx) 
 			{
@@ -154,8 +257,6 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 				newCollision.impactNormal = Vector2<real>{ 1, 0 };
 
 				outInfo.push_back(newCollision);
-
-				bCollisionFound = true;
 			}
 		}
 		if (!yWrap)
@@ -168,8 +269,6 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 				newCollision.impactNormal = Vector2<real>{ 0, -1 };
 
 				outInfo.push_back(newCollision);
-
-				bCollisionFound = true;
 			}
 			else if (collider->p.y + particleRadius > Ly)
 			{
@@ -179,18 +278,187 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 				newCollision.impactNormal = Vector2<real>{ 0, 1 };
 
 				outInfo.push_back(newCollision);
+			}
+		}
 
-				bCollisionFound = true;
+		return !outInfo.empty();
+	}
+	// Earliest t in [0, tMax] at which d0 + dv * t is as long as the contact radius. Only pairs
+	// closing in from outside count, touching ones are left to Interact() and Depenetrate()
+	bool TimeOfImpact(const Vector2<real>& d0, const Vector2<real>& dv, real tMax, real& t) const
+	{
+		const real b = d0 * dv;
+		if (b >= 0)
+			return false;
+		const real R = ContactRadius();
+		const real a = dv.SizeSqr();
+		const real c = d0.SizeSqr() - R * R;
+		if (c <= 0)
+			return false;
+		const real discriminant = b * b - a * c;
+		if (discriminant < 0)
+			return false;
+		// Smaller root of a t^2 + 2 b t + c, in the form that doesn't cancel
+		t = c / (-b + sqrt(discriminant));
+		return t <= tMax;
+	}
+	Vector2<real> SweptPosition(int i, real t) const
+	{
+		return components[i].p + components[i].v * (t - sweptTime[i]);
+	}
+	// Pair events of i with its swept partners and its wall events, from time t to the end of the step
+	template<typename Sink>
+	void PredictImpacts(int i, real t, Sink&& sink)
+	{
+		const Vector2<real> p = SweptPosition(i, t);
+		const Vector2<real>& v = components[i].v;
+		for (int k = swept.start[i]; k < swept.start[i + 1]; ++k)
+		{
+			const int j = swept.neighbours[k];
+			real toi;
+			if (TimeOfImpact(p - SweptPosition(j, t), v - components[j].v, dt - t, toi))
+				sink(ImpactEvent<real>{ t + toi, (std::min)(i, j), (std::max)(i, j), 0, 0 });
+		}
+		const real walls[4][2] = { { p.x - particleRadius, -v.x }, { Lx - particleRadius - p.x, v.x },
+			{ p.y - particleRadius, -v.y }, { Ly - particleRadius - p.y, v.y } };
+		for (int wall = 0; wall < 4; ++wall)
+		{
+			if ((wall < 2 ? xWrap : yWrap) || walls[wall][1] <= 0 || walls[wall][0] < 0)
+				continue;
+			const real toi = walls[wall][0] / walls[wall][1];
+			if (toi <= dt - t)
+				sink(ImpactEvent<real>{ t + toi, i, -1 - wall, 0, 0 });
+		}
+	}
+	// Closest the two come within the step if neither changes course
+	real ClosestApproachSqr(int i, int j) const
+	{
+		const Vector2<real> d0 = components[j].p - components[i].p;
+		const Vector2<real> dv = components[j].v - components[i].v;
+		const real speedSqr = dv.SizeSqr();
+		const real t = speedSqr > 0 ? min(max(-(d0 * dv) / speedSqr, real(0)), dt) : real(0);
+		return (d0 + dv * t).SizeSqr();
+	}
+	// Candidates: every pair close enough for two slow particles, plus the ones a fast
+	// particle passes within reach of on its way. Fast particles don't bin into the cells
+	// they cross, so those are looked up along the way
+	void FindSweptPairs()
+	{
+		GatherPairs(components, SweptRadius());
+		const real slowTravel = particleRadius;
+		const real reach = ContactRadius() + slowTravel;
+		const real sweptRadiusSqr = SweptRadius() * SweptRadius();
+		std::vector<int> fast;
+		for (int i = 0; i < N; ++i)
+			if (components[i].v.Size() * dt > slowTravel)
+				fast.push_back(i);
+		for (size_t f = 0; f < fast.size(); ++f)
+		{
+			const int i = fast[f];
+			const Vector2<real> from = components[i].p;
+			const Vector2<real> to = from + components[i].v * dt;
+			const Vector2<real> lo = { min(from.x, to.x) - reach, min(from.y, to.y) - reach };
+			const Vector2<real> hi = { max(from.x, to.x) + reach, max(from.y, to.y) + reach };
+			grid.ForEachCellIn(lo, hi, [&](int cell)
+			{
+				for (int b = grid.cellStart[cell]; b < grid.cellStart[cell + 1]; ++b)
+				{
+					const int j = grid.items[b];
+					// Pairs of two fast ones come from the loop below
+					if (components[j].v.Size() * dt > slowTravel)
+						continue;
+					if ((components[j].p - from).SizeSqr() > sweptRadiusSqr && ClosestApproachSqr(i, j) <= reach * reach)
+						pairs.push_back(std::make_pair(i, j));
+				}
+			});
+			for (size_t g = f + 1; g < fast.size(); ++g)
+			{
+				const int j = fast[g];
+				if ((components[j].p - from).SizeSqr() > sweptRadiusSqr && ClosestApproachSqr(i, j) <= reach * reach)
+					pairs.push_back(std::make_pair(i, j));
 			}
 		}
+		swept.Build(pairs, N);
+	}
+	// Event-driven inside the step, only for the particles that have events. Every collision
+	// moves its particles to the time of impact and predicts their next events from there.
+	// The rest of the step is taken by Step(). Chains past maxEvents, and partners that
+	// a collision sends somewhere the candidates didn't cover, are left to Depenetrate()
+	void SweepCollisions()
+	{
+		FindSweptPairs();
+		sweptTime.assign(N, real(0));
+		sweptCount.assign(N, 0);
+		threadEvents.resize(nThreads);
+#pragma omp parallel num_threads(nThreads)
+		{
+			std::vector<ImpactEvent<real>>& local = threadEvents[omp_get_thread_num()];
+			local.clear();
+#pragma omp for schedule(dynamic, 64)
+			for (int i = 0; i < N; ++i)
+				PredictImpacts(i, real(0), [&](const ImpactEvent<real>& e)
+				{
+					// Pairs are seen from both ends
+					if (e.other < 0 || e.i == i)
+						local.push_back(e);
+				});
+		}
+		std::vector<ImpactEvent<real>> initial;
+		for (int t = 0; t < int(threadEvents.size()); ++t)
+			initial.insert(initial.end(), threadEvents[t].begin(), threadEvents[t].end());
+		events = decltype(events)(std::greater<ImpactEvent<real>>(), std::move(initial));
+
+		const int maxEvents = 4 * N + 64;
+		int nEvents = 0;
+		while (!events.empty() && nEvents < maxEvents)
+		{
+			const ImpactEvent<real> e = events.top();
+			events.pop();
+			if (e.countI != sweptCount[e.i] || (e.other >= 0 && e.countOther != sweptCount[e.other]))
+				continue;
 
-		return bCollisionFound;
+			Component<real>& a = components[e.i];
+			a.p = SweptPosition(e.i, e.t);
+			sweptTime[e.i] = e.t;
+			++sweptCount[e.i];
+			if (e.other >= 0)
+			{
+				Component<real>& b = components[e.other];
+				b.p = SweptPosition(e.other, e.t);
+				sweptTime[e.other] = e.t;
+				++sweptCount[e.other];
+				// Same impulse Interact() gives a touching pair
+				Vector2<real> d = a.p - b.p;
+				Vector2<real> dv = a.v - b.v;
+				const Vector2<real> impulse = (d * dv) / d.SizeSqr() * d;
+				a.v -= impulse;
+				b.v += impulse;
+			}
+			else if (e.other >= -2)
+				a.v.x = -a.v.x;
+			else
+				a.v.y = -a.v.y;
+			++nEvents;
+
+			const int involved[] = { e.i, e.other };
+			for (int side = 0; side < (e.other >= 0 ? 2 : 1); ++side)
+				PredictImpacts(involved[side], e.t, [&](ImpactEvent<real> next)
+				{
+					next.countI = sweptCount[next.i];
+					next.countOther = next.other >= 0 ? sweptCount[next.other] : 0;
+					events.push(next);
+				});
+		}
+		events = decltype(events)();
+		sweptCollisions += nEvents;
 	}
 	void Step() 
 	{
+		if (bContinuousCollisions)
+			SweepCollisions();
 		for (int i = 0; i < N; ++i)
 		{
-			components[i].p += components[i].v * dt;
+			components[i].p += components[i].v * (dt - (sweptTime.empty() ? real(0) : sweptTime[i]));
 
 			if (xWrap)
 			{
@@ -207,92 +475,164 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 					components[i].p.y = components[i].p.y - Ly;
 			}
 		}
+		sweptTime.clear();
 		components0 = components;
 	}
+	// Jacobi: every particle reads components0 and writes only its own velocity in components,
+	// so particles go to threads in any order with the same result
 	void Interact() 
 	{
-		std::vector<CollisionInfo<real>> colInfo;
-		colInfo.reserve(N - 1);
-
-		for (int i = 0; i < N; ++i) 
+		FindPairs(components0, ContactRadius(), contacts);
+		int doubles = 0, triples = 0, quads = 0;
+#pragma omp parallel num_threads(nThreads) reduction(+:doubles, triples, quads)
 		{
-			Component<real>* thisComp = &components0[i];
-			Vector2<real> cumulativeV = { 0, 0 };
-
-			if (FindAllCollisionsWith(colInfo, thisComp, components0)) 
+			std::vector<CollisionInfo<real>> colInfo;
+#pragma omp for schedule(dynamic, 64)
+			for (int i = 0; i < N; ++i) 
 			{
-				int numDirectCollisions = 0;
+				Component<real>* thisComp = &components0[i];
+				Vector2<real> cumulativeV = { 0, 0 };
 
-				for (CollisionInfo<real>& col : colInfo) if (col.otherComponent) 
+				if (FindAllCollisionsWith(colInfo, i, components0, contacts)) 
 				{
-					Vector2<real> d = thisComp->p - col.otherComponent->p;
-					Vector2<real> dv = thisComp->v - col.otherComponent->v;
-
-					if (d * dv > 0) // Ignore separating collisions
-						continue;
+					int numDirectCollisions = 0;
 
-					if (real ssqr = d.SizeSqr() > 0.000001)
+					for (CollisionInfo<real>& col : colInfo) if (col.otherComponent) 
+					{
+						Vector2<real> d = thisComp->p - col.otherComponent->p;
+						Vector2<real> dv = thisComp->v - col.otherComponent->v;
+
+						if (d * dv > 0) // Ignore separating collisions
+							continue;
+
+						if (real ssqr = d.SizeSqr() > 0.000001)
+						{
+							cumulativeV += (d * dv) / d.SizeSqr() * d;
+							numDirectCollisions++;
+							break;
+						}
+					}
+					switch(numDirectCollisions)
 					{
-						cumulativeV += (d * dv) / d.SizeSqr() * d;
-						numDirectCollisions++;
+					case 1: doubles++;
+						break;
+					case 2: triples++;
+						break;
+					case 3: quads++;
 						break;
 					}
-				}
-				switch(numDirectCollisions)
-				{
-				case 1: doubleCollisions++;
-					break;
-				case 2: tripleCollisions++;
-					break;
-				case 3: quadCollisions++;
-					break;
-				}
-				if (numDirectCollisions != 0) components[i].v -= cumulativeV / sqrt(real(numDirectCollisions));
+					if (numDirectCollisions != 0) components[i].v -= cumulativeV / sqrt(real(numDirectCollisions));
 
-				for (CollisionInfo<real>& col : colInfo) if (!col.otherComponent)
-					components[i].v += -2 * (components[i].v * col.impactNormal) * col.impactNormal;
+					for (CollisionInfo<real>& col : colInfo) if (!col.otherComponent)
+						components[i].v += -2 * (components[i].v * col.impactNormal) * col.impactNormal;
+				}
 			}
 		}
+		doubleCollisions += doubles;
+		tripleCollisions += triples;
+		quadCollisions += quads;
 	}
 	void UpdateTimestep() 
 	{
-		// v * dt < rad
+		// v * dt < rad, for the fastest particle or with swept collisions for the RMS speed
 		real maxV = 0;
-		for (int i = 0; i < N; ++i)
-			maxV = max(maxV, components[i].v.SizeSqr());
+		if (bContinuousCollisions)
+		{
+			for (int i = 0; i < N; ++i)
+				maxV += components[i].v.SizeSqr();
+			maxV /= N;
+		}
+		else
+			for (int i = 0; i < N; ++i)
+				maxV = max(maxV, components[i].v.SizeSqr());
 
 		dt = min(particleRadius / (sqrt(maxV) + 0.0001), real(0.01667)) * ATSMultiplier;
 	}
-	void Depenetrate(std::vector<Component<real>>& comps)
+	// Deepest overlap of the pairs just found and of the walls
+	real MaxOverlap(const ComponentVector<real>& comps)
+	{
+		const real contactRadius = ContactRadius();
+		const int nPairs = int(pairs.size());
+		// A nested region may get fewer threads than asked for
+		for (int t = 0; t < threadMaxOverlap.Size(); ++t)
+			threadMaxOverlap[t] = 0;
+#pragma omp parallel num_threads(nThreads)
+		{
+			real overlap = 0;
+#pragma omp for schedule(static) nowait
+			for (int k = 0; k < nPairs; ++k)
+			{
+				Vector2<real> d = comps[pairs[k].second].p - comps[pairs[k].first].p;
+				overlap = max(overlap, contactRadius - d.Size());
+			}
+#pragma omp for schedule(static) nowait
+			for (int i = 0; i < N; ++i)
+			{
+				const Vector2<real>& p = comps[i].p;
+				if (!xWrap)
+					overlap = max(overlap, max(particleRadius - p.x, p.x + particleRadius - Lx));
+				if (!yWrap)
+					overlap = max(overlap, max(particleRadius - p.y, p.y + particleRadius - Ly));
+			}
+			threadMaxOverlap[omp_get_thread_num()] = overlap;
+		}
+		return threadMaxOverlap.Max(nThreads);
+	}
+	// Both particles move half of the way out
+	void ProjectPair(ComponentVector<real>& comps, const std::pair<int, int>& pair, real target)
+	{
+		Component<real>& a = comps[pair.first];
+		Component<real>& b = comps[pair.second];
+		Vector2<real> d = b.p - a.p;
+		const real distance = d.Size();
+		if (distance >= target)
+			return;
+		const Vector2<real> push = d.Normalized() * (real(0.5) * (target - distance));
+		a.p -= push;
+		b.p += push;
+	}
+	void ProjectWalls(Component<real>& comp)
+	{
+		const real inside = particleRadius * (depenetrationBonus + 1);
+		if (!xWrap)
+			comp.p.x = min(max(comp.p.x, inside), Lx - inside);
+		if (!yWrap)
+			comp.p.y = min(max(comp.p.y, inside), Ly - inside);
+	}
+	// Position projection on all contacts at once. Every iteration gathers the overlapping pairs,
+	// colours them so no two pairs of a colour share a particle and projects colour by colour,
+	// each colour in parallel, walls last. The result doesn't depend on the number of threads
+	void Depenetrate(ComponentVector<real>& comps)
 	{
 		if (depenetrationSteps <= 0)
 			return;
 
-		std::vector<CollisionInfo<real>> colInfo;
-		colInfo.reserve(N - 1);
-
-		for (int i = 0; i < N; ++i) 
+		const real target = ContactRadius() * (depenetrationBonus + 1);
+		real residual = 0;
+		int iteration = 0;
+		for (;; ++iteration)
 		{
-			Component<real>* thisComp = &comps[i];
-			for (int n = 0;
-				n < depenetrationSteps && FindAllCollisionsWith(colInfo, thisComp, comps);
-				++n)
+			FindPairs(comps, ContactRadius(), contacts);
+			residual = MaxOverlap(comps);
+			if (residual <= depenetrationTolerance * particleRadius || iteration == depenetrationSteps)
+				break;
+
+			contacts.ColourPairs(pairs);
+#pragma omp parallel num_threads(nThreads)
 			{
-				for (auto& col : colInfo) 
+				for (int c = 0; c < contacts.nColours; ++c)
 				{
-					if (col.otherComponent)
-					{
-						Vector2<real> d = col.otherComponent->p - thisComp->p;
-						real depenetrationCoef = d.Size() - particleRadius;
-						thisComp->p -= col.impactNormal * depenetrationCoef * (depenetrationBonus + 1);
-					}
-					else
-					{
-						thisComp->p = col.impactPoint - col.impactNormal * particleRadius * (depenetrationBonus + 1);
-					}
+#pragma omp for schedule(static)
+					for (int k = contacts.colourStart[c]; k < contacts.colourStart[c + 1]; ++k)
+						ProjectPair(comps, pairs[contacts.colourItems[k]], target);
 				}
+#pragma omp for schedule(static)
+				for (int i = 0; i < N; ++i)
+					ProjectWalls(comps[i]);
 			}
 		}
+		depenetrationIterations = max(depenetrationIterations, iteration);
+		depenetrationResidual = max(depenetrationResidual, residual / particleRadius);
 	}
 	void CollectStats()
 	{
@@ -311,11 +651,37 @@ class StepperSimulator : private StepperProperties<real>, virtual public ISimula
 		tripleCollisionsMax = max(tripleCollisionsMax, tripleCollisions);
 		quadCollisionsMax = max(quadCollisionsMax, quadCollisions);
 
-		stats["E"] = E;
-		stats["I"] = I;
-		stats["ColDoubles"] = real(doubleCollisionsMax);
-		stats["ColTriples"] = real(tripleCollisionsMax);
-		stats["ColQuadruples"] = real(quadCollisionsMax);
+		stats.Set(handles.E, E);
+		stats.Set(handles.I, I);
+		stats.Set(handles.colDoubles, real(doubleCollisionsMax));
+		stats.Set(handles.colTriples, real(tripleCollisionsMax));
+		stats.Set(handles.colQuadruples, real(quadCollisionsMax));
+		stats.Set(handles.time, _time);
+		if (bContinuousCollisions)
+			stats.Set(handles.swept, real(sweptCollisions));
+		if (depenetrationSteps > 0)
+		{
+			stats.Set(handles.depenIterations, real(depenetrationIterations));
+			stats.Set(handles.depenResidual, depenetrationResidual);
+		}
+		stats.Publish();
+	}
+	void SetupStats()
+	{
+		stats.Clear();
+		handles.E = stats.Register("E");
+		handles.I = stats.Register("I");
+		handles.colDoubles = stats.Register("ColDoubles");
+		handles.colTriples = stats.Register("ColTriples");
+		handles.colQuadruples = stats.Register("ColQuadruples");
+		handles.time = stats.Register("Time");
+		if (bContinuousCollisions)
+			handles.swept = stats.Register("Swept collisions");
+		if (depenetrationSteps > 0)
+		{
+			handles.depenIterations = stats.Register("Depen iterations");
+			handles.depenResidual = stats.Register("Depen residual");
+		}
 	}
 
 public:
@@ -330,6 +696,11 @@ public:
 		doubleCollisionsMax = doubleCollisions =
 			tripleCollisionsMax = tripleCollisions =
 			quadCollisionsMax = quadCollisions = 0;
+		depenetrationIterations = 0;
+		depenetrationResidual = 0;
+		sweptCollisions = 0;
+		_time = 0;
+		SetupStats();
 	}
 	virtual void Update() 
 	{
@@ -341,6 +712,7 @@ public:
 				Depenetrate(components);
 				if (bUseAdaptiveTimeStep) UpdateTimestep();
 				Step();
+				_time += dt;
 			}
 			CollectStats();
 			ResetStats();
@@ -350,6 +722,9 @@ public:
 	virtual void ResetStats() 
 	{
 		doubleCollisions = tripleCollisions = quadCollisions = 0;
+		depenetrationIterations = 0;
+		depenetrationResidual = 0;
+		sweptCollisions = 0;
 	}
 	virtual bool GetSimulate() const { return bSimulate; }
 	virtual void SetSimulate(bool newSimulate) { bSimulate = newSimulate; }
@@ -357,11 +732,12 @@ public:
 	virtual int GetN() const { return N; }
 	virtual real GetDt() const { return dt; }
 
-	virtual const std::vector<Component<real>>& GetComponents() const override { return components; }
-	virtual const std::map<std::string, real>& GetStats() const override { return stats; }
+	virtual const ComponentVector<real>& GetComponents() const override { return components; }
+	virtual const StatsRegistry<real>& GetStatsRegistry() const override { return stats; }
 	virtual Vector2<real> GetDims() const { return { Lx, Ly }; }
 
 	virtual void SetGPUSimulation(bool newGPUSim) { /*Unsupported*/ }
 	virtual bool GetGPUSimulation() const { return false; }
+	virtual void SetSeed(unsigned int newSeed) override { seed = newSeed; }
 	/*End ISimulator interface*/
 };
\ No newline at end of file
@@ -0,0 +1,195 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "Types.h"
+
+// g(r) and S(k), averaged over every sample since Setup().
+// Pair distances come from the force passes, each thread bins into its own histogram and the
+// histograms are merged once per update. S(k) is taken from the density modes
+// rho(k) = sum exp(i k.p) on the k-grid of the box, S(k) = |rho(k)|^2 / n, averaged over shells of |k|.
+// Modes() only reads the setup, it can run on a snapshot of the positions next to the steps
+template<typename real>
+struct StructureAccumulator
+{
+	int nBins = 0;
+	real rMax = 0;
+	real binScale = 0;
+	// Pairs per bin over all samples, and what an ideal gas of the same density would have put
+	// into a ring of unit area
+	std::vector<double> pairCounts;
+	double idealPairDensity = 0;
+	int nSamples = 0;
+
+	// Half plane of k = 2 pi (nx / Lx, ny / Ly) with nx^2 + ny^2 <= maxMode^2, k = 0 left out
+	int maxMode = 0;
+	std::vector<int> modeX;
+	std::vector<int> modeY;
+	std::vector<int> modeShell;
+	real shellWidth = 0;
+	std::vector<double> shellSums;
+	std::vector<int> shellCounts;
+	int nModeSamples = 0;
+
+	bool Enabled() const { return nBins > 0; }
+	bool ModesEnabled() const { return !modeX.empty(); }
+	int NumModes() const { return int(modeX.size()); }
+	double* ThreadBins(int thread) { return threadBins[thread].data(); }
+
+	void Setup(int nThreads, int bins, real radius, int modes, const Vector2<real>& L)
+	{
+		nBins = radius > 0 ? (std::max)(0, bins) : 0;
+		rMax = radius;
+		binScale = nBins > 0 ? nBins / rMax : real(0);
+		pairCounts.assign(nBins, 0.0);
+		threadBins.assign(nThreads, std::vector<double>(nBins, 0.0));
+		idealPairDensity = 0;
+		nSamples = 0;
+
+		box = L;
+		maxMode = nBins > 0 ? (std::max)(0, modes) : 0;
+		modeX.clear();
+		modeY.clear();
+		modeShell.clear();
+		const real pi = real(3.14159265358979);
+		shellWidth = real(2.0) * pi / (std::max)(L.x, L.y);
+		int nShells = 0;
+		for (int nx = 0; nx <= maxMode; ++nx)
+			for (int ny = -maxMode; ny <= maxMode; ++ny)
+			{
+				if (nx == 0 && ny <= 0)
+					continue;
+				if (nx * nx + ny * ny > maxMode * maxMode)
+					continue;
+				modeX.push_back(nx);
+				modeY.push_back(ny);
+				const int shell = int(K(nx, ny).Size() / shellWidth + real(0.5));
+				modeShell.push_back(shell);
+				nShells = (std::max)(nShells, shell + 1);
+			}
+		shellSums.assign(nShells, 0.0);
+		shellCounts.assign(nShells, 0);
+		for (int shell : modeShell)
+			++shellCounts[shell];
+		nModeSamples = 0;
+	}
+
+	Vector2<real> K(int nx, int ny) const
+	{
+		const real pi = real(3.14159265358979);
+		return { real(2.0) * pi * nx / box.x, real(2.0) * pi * ny / box.y };
+	}
+
+	// weight is 1/2 for a pair that another rank also sees
+	__forceinline void AddPair(double* bins, real r, real weight) const
+	{
+		const int bin = int(r * binScale);
+		if (bin < nBins)
+			bins[bin] += weight;
+	}
+	// n particles in the box of the sampled pass
+	void AddSample(int n)
+	{
+		idealPairDensity += 0.5 * double(n) * (n - 1) / (double(box.x) * box.y);
+		++nSamples;
+	}
+
+	// Phases are unit vectors (cos, sin), multiplying two adds their angles.
+	// Not std::complex, <complex> makes real ambiguous in every file that says using namespace std
+	static Vector2<double> Rotate(const Vector2<double>& a, const Vector2<double>& b)
+	{
+		return { a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x };
+	}
+	// Both parts of rho(k) for every mode of n points. The phases along each axis are stepped
+	// by multiplying, so there are two sincos per point instead of one per mode
+	void Modes(const Vector2<real>* points, int n, std::vector<double>& rho) const
+	{
+		rho.assign(2 * modeX.size(), 0.0);
+		std::vector<Vector2<double>> phaseX(maxMode + 1);
+		std::vector<Vector2<double>> phaseY(maxMode + 1);
+		const Vector2<real> k1 = K(1, 1);
+		for (int i = 0; i < n; ++i)
+		{
+			const double angleX = double(k1.x) * points[i].x;
+			const double angleY = double(k1.y) * points[i].y;
+			const Vector2<double> stepX = { std::cos(angleX), std::sin(angleX) };
+			const Vector2<double> stepY = { std::cos(angleY), std::sin(angleY) };
+			phaseX[0] = phaseY[0] = { 1.0, 0.0 };
+			for (int m = 1; m <= maxMode; ++m)
+			{
+				phaseX[m] = Rotate(phaseX[m - 1], stepX);
+				phaseY[m] = Rotate(phaseY[m - 1], stepY);
+			}
+			for (int k = 0; k < NumModes(); ++k)
+			{
+				const int ny = modeY[k];
+				// Negative modes turn the other way
+				const Vector2<double> y = ny >= 0 ? phaseY[ny] : Vector2<double>{ phaseY[-ny].x, -phaseY[-ny].y };
+				const Vector2<double> phase = Rotate(phaseX[modeX[k]], y);
+				rho[2 * k] += phase.x;
+				rho[2 * k + 1] += phase.y;
+			}
+		}
+	}
+	// rho(k) of a sample of n particles, summed over ranks
+	void AddModeSample(const double* rho, int n)
+	{
+		if (n <= 0)
+			return;
+		for (int k = 0; k < NumModes(); ++k)
+			shellSums[modeShell[k]] += (rho[2 * k] * rho[2 * k] + rho[2 * k + 1] * rho[2 * k + 1]) / n;
+		++nModeSamples;
+	}
+	void AddCounts(const std::vector<double>& merged)
+	{
+		for (int b = 0; b < nBins; ++b)
+			pairCounts[b] += merged[b];
+	}
+
+	// Sums the threads' histograms into merged and clears them
+	void GatherBins(std::vector<double>& merged, int nThreads)
+	{
+		merged.assign(nBins, 0.0);
+		for (int t = 0; t < nThreads; ++t)
+			for (int b = 0; b < nBins; ++b)
+			{
+				merged[b] += threadBins[t][b];
+				threadBins[t][b] = 0;
+			}
+	}
+
+	// Bin centres and g(r) of everything so far
+	void RadialDistribution(std::vector<real>& r, std::vector<real>& g) const
+	{
+		const real pi = real(3.14159265358979);
+		r.resize(nBins);
+		g.resize(nBins);
+		for (int b = 0; b < nBins; ++b)
+		{
+			const real lo = b / binScale;
+			const real hi = (b + 1) / binScale;
+			r[b] = real(0.5) * (lo + hi);
+			const double ideal = idealPairDensity * pi * (hi * hi - lo * lo);
+			g[b] = ideal > 0 ? real(pairCounts[b] / ideal) : real(0);
+		}
+	}
+	// Only the shells that have modes in them
+	void StructureFactor(std::vector<real>& k, std::vector<real>& s) const
+	{
+		k.clear();
+		s.clear();
+		if (nModeSamples == 0)
+			return;
+		for (size_t shell = 0; shell < shellSums.size(); ++shell)
+		{
+			if (shellCounts[shell] == 0)
+				continue;
+			k.push_back(shell * shellWidth);
+			s.push_back(real(shellSums[shell] / (double(shellCounts[shell]) * nModeSamples)));
+		}
+	}
+
+private:
+	Vector2<real> box;
+	std::vector<std::vector<double>> threadBins;
+};
@@ -0,0 +1,364 @@
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <omp.h>
+#include "ISimulator.h"
+#include "VerletSimulator.h"
+#include "StepperSimulator.h"
+#include "ThreadHelpers.h"
+#include "inipp.h"
+#include "IniHelpers.h"
+
+template<typename real>
+struct SweepProperties
+{
+	// 0 VerletSimulator, 1 StepperSimulator
+	int simulatorType = 0;
+	int nUpdates = 100;
+	// Stats of the first updates are left out of the averages
+	int nWarmupUpdates = 10;
+	int nThreads = 0;
+	std::string outputFilename;
+	std::string checkpointFilename;
+};
+
+// Runs every combination of the values listed in the [SWEEP] section. Keys of the form
+// SECTION.param are sweep axes, their value is a list "a, b, c" or an inclusive range
+// "start:stop:step", and the jobs are the cartesian product of all axes. Every job is a copy
+// of the config with those values set, run for nUpdates with its stats averaged after warmup,
+// block means and errors are those of the last update.
+// Finished jobs are appended to the checkpoint, a rerun only does the missing ones.
+template<typename real>
+class SweepRunner : private SweepProperties<real>
+{
+	struct Axis
+	{
+		std::string section;
+		std::string param;
+		std::vector<std::string> values;
+	};
+	struct Job
+	{
+		int id = 0;
+		std::vector<std::string> values;
+		double cost = 0;
+		bool bDone = false;
+		std::map<std::string, real> results;
+	};
+
+	inipp::Ini<char> baseIni;
+	std::vector<Axis> axes;
+	std::vector<Job> jobs;
+
+	static bool EndsWith(const std::string& s, const std::string& suffix)
+	{
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+	static std::string Format(double value)
+	{
+		std::ostringstream out;
+		out.precision(10);
+		out << value;
+		return out.str();
+	}
+	static std::vector<std::string> ExpandSpec(const std::string& spec)
+	{
+		std::vector<std::string> values;
+		if (spec.find(':') != std::string::npos)
+		{
+			double start = 0, stop = 0, step = 0;
+			char colon;
+			std::istringstream in(spec);
+			if (!(in >> start >> colon >> stop >> colon >> step) || step <= 0)
+			{
+				cout << "Bad sweep range " << spec << ", expected start:stop:step" << endl;
+				return values;
+			}
+			const int count = int((stop - start) / step + 1e-9) + 1;
+			for (int k = 0; k < count; ++k)
+				values.push_back(Format(start + k * step));
+			return values;
+		}
+		return SplitList(spec);
+	}
+
+	// Pair evaluations over the whole job, enough to order jobs against each other
+	double EstimateCost(inipp::Ini<char>& ini) const
+	{
+		double N = 0, nAvg = 1;
+		if (simulatorType == 1)
+		{
+			inipp::extract(ini.sections["STEPPER"]["N"], N);
+			inipp::extract(ini.sections["STEPPER"]["nAvg"], nAvg);
+			return N * N * nAvg * nUpdates;
+		}
+		double Lx = 1, Ly = 1, sigma = 1, cutoffRadius = 0;
+		inipp::extract(ini.sections["VERLET"]["N"], N);
+		inipp::extract(ini.sections["VERLET"]["nAvg"], nAvg);
+		inipp::extract(ini.sections["VERLET"]["Lx"], Lx);
+		inipp::extract(ini.sections["VERLET"]["Ly"], Ly);
+		inipp::extract(ini.sections["VERLET"]["sigma"], sigma);
+		inipp::extract(ini.sections["VERLET"]["cutoffRadius"], cutoffRadius);
+		double neighbours = N;
+		if (cutoffRadius > 0)
+		{
+			const double rc = cutoffRadius * sigma;
+			neighbours = (std::min)(N, N / (Lx * Ly) * 3.14159265 * rc * rc);
+		}
+		return N * neighbours * nAvg * nUpdates;
+	}
+	// Jobs are headless and share one process, so they run on the CPU without domains
+	// whatever the config or an axis says
+	inipp::Ini<char> JobIni(const Job& job) const
+	{
+		inipp::Ini<char> ini = baseIni;
+		ini.sections.erase("SWEEP");
+		for (size_t a = 0; a < axes.size(); ++a)
+			ini.sections[axes[a].section][axes[a].param] = job.values[a];
+		ini.sections["VERLET"]["bSimulateOnGPU"] = "0";
+		ini.sections["VERLET"]["domainsX"] = "1";
+		ini.sections["VERLET"]["domainsY"] = "1";
+		// A timed kernel can differ between jobs and reruns, and the trajectories with it
+		int kernel = ForceKernelCells;
+		inipp::extract(ini.sections["VERLET"]["forceKernel"], kernel);
+		if (kernel == ForceKernelAuto)
+			ini.sections["VERLET"]["forceKernel"] = std::to_string(int(ForceKernelCells));
+		return ini;
+	}
+
+	std::string CheckpointLine(const Job& job) const
+	{
+		std::ostringstream line;
+		line.precision(10);
+		line << "job\t" << job.id;
+		for (const std::string& value : job.values)
+			line << "\t" << value;
+		for (auto& result : job.results)
+			line << "\t" << result.first << "=" << result.second;
+		return line.str();
+	}
+	// Lines whose axis values don't match the current expansion are from another sweep
+	void LoadCheckpoint()
+	{
+		std::ifstream in(checkpointFilename);
+		std::string line;
+		int nLoaded = 0;
+		while (std::getline(in, line))
+		{
+			std::vector<std::string> fields;
+			std::istringstream fieldStream(line);
+			std::string field;
+			while (std::getline(fieldStream, field, '\t'))
+				fields.push_back(field);
+			if (fields.size() < 2 + axes.size() || fields[0] != "job")
+				continue;
+			const int id = atoi(fields[1].c_str());
+			if (id < 0 || id >= int(jobs.size()))
+				continue;
+			Job& job = jobs[id];
+			if (!std::equal(job.values.begin(), job.values.end(), fields.begin() + 2))
+				continue;
+			job.results.clear();
+			for (size_t f = 2 + axes.size(); f < fields.size(); ++f)
+			{
+				size_t eq = fields[f].rfind('=');
+				if (eq != std::string::npos)
+					job.results[fields[f].substr(0, eq)] = real(atof(fields[f].substr(eq + 1).c_str()));
+			}
+			job.bDone = true;
+			++nLoaded;
+		}
+		if (nLoaded > 0)
+			cout << "Checkpoint has " << nLoaded << " of " << jobs.size() << " jobs done" << endl;
+	}
+
+	void RunJob(Job& job)
+	{
+		const std::string jobConfig = "sweep_job" + std::to_string(job.id) + ".ini";
+		JobIni(job).generate(std::ofstream(jobConfig));
+
+		std::unique_ptr<ISimulator<real>> sim;
+		if (simulatorType == 1)
+			sim.reset(new StepperSimulator<real>);
+		else
+			sim.reset(new VerletSimulator<real>);
+		sim->SetOutputSuffix("_job" + std::to_string(job.id));
+		sim->Initialize(jobConfig);
+		sim->SetSimulate(true);
+
+		// Per stat, a value that isn't finite yet, like an error before there are blocks, is left out
+		std::map<std::string, double> sums;
+		std::map<std::string, int> counts;
+		for (int u = 0; u < nUpdates; ++u)
+		{
+			// A run that reached its target error stops by itself
+			if (!sim->GetSimulate())
+				break;
+			sim->Update();
+			if (u < nWarmupUpdates)
+				continue;
+			for (auto& stat : sim->GetStats())
+			{
+				if (!std::isfinite(double(stat.second)))
+					continue;
+				sums[stat.first] += stat.second;
+				++counts[stat.first];
+			}
+		}
+		sim->WriteOutputs();
+		job.results.clear();
+		for (auto& sum : sums)
+			job.results[sum.first] = real(sum.second / counts[sum.first]);
+		// Time is where the run ended, and the block means and errors already cover the whole run,
+		// those are taken from the last update rather than averaged
+		for (auto& stat : sim->GetStats())
+			if (stat.first == "Time" || EndsWith(stat.first, " mean") || EndsWith(stat.first, " error"))
+				job.results[stat.first] = stat.second;
+		std::remove(jobConfig.c_str());
+	}
+	void WriteTable() const
+	{
+		std::set<std::string> names;
+		for (const Job& job : jobs)
+			for (auto& result : job.results)
+				names.insert(result.first);
+
+		std::ofstream out(outputFilename);
+		out.precision(10);
+		for (size_t a = 0; a < axes.size(); ++a)
+			out << (a > 0 ? "\t" : "") << axes[a].section << "." << axes[a].param;
+		for (const std::string& name : names)
+			out << "\t" << name;
+		out << std::endl;
+		for (const Job& job : jobs)
+		{
+			if (!job.bDone)
+				continue;
+			for (size_t a = 0; a < job.values.size(); ++a)
+				out << (a > 0 ? "\t" : "") << job.values[a];
+			for (const std::string& name : names)
+			{
+				auto result = job.results.find(name);
+				out << "\t";
+				if (result != job.results.end())
+					out << result->second;
+			}
+			out << std::endl;
+		}
+	}
+
+public:
+	bool Initialize(const std::string& filename)
+	{
+		baseIni = inipp::Ini<char>();
+		{
+			struct stat buffer;
+			if (stat(filename.c_str(), &buffer) == 0)
+				baseIni.parse(std::ifstream(filename));
+		}
+		InitializeValue("SWEEP", "simulatorType", simulatorType, 0, baseIni);
+		InitializeValue("SWEEP", "nUpdates", nUpdates, 100, baseIni);
+		InitializeValue("SWEEP", "nWarmupUpdates", nWarmupUpdates, 10, baseIni);
+		InitializeValue("SWEEP", "nThreads", nThreads, 0, baseIni);
+		InitializeValue("SWEEP", "outputFilename", outputFilename, std::string("sweep_results.txt"), baseIni);
+		InitializeValue("SWEEP", "checkpointFilename", checkpointFilename, std::string("sweep_checkpoint.txt"), baseIni);
+		baseIni.generate(std::ofstream(filename));
+		nWarmupUpdates = (std::max)(0, (std::min)(nWarmupUpdates, nUpdates - 1));
+
+		axes.clear();
+		for (auto& entry : baseIni.sections["SWEEP"])
+		{
+			size_t dot = entry.first.find('.');
+			if (dot == std::string::npos)
+				continue;
+			Axis axis;
+			axis.section = entry.first.substr(0, dot);
+			axis.param = entry.first.substr(dot + 1);
+			axis.values = ExpandSpec(entry.second);
+			if (axis.values.empty())
+				return false;
+			axes.push_back(axis);
+		}
+		if (axes.empty())
+		{
+			cout << "No SECTION.param keys in [SWEEP], nothing to sweep" << endl;
+			return false;
+		}
+		if (simulatorType == 0)
+		{
+			int bGPU = 0, domainsX = 1, domainsY = 1;
+			inipp::extract(baseIni.sections["VERLET"]["bSimulateOnGPU"], bGPU);
+			inipp::extract(baseIni.sections["VERLET"]["domainsX"], domainsX);
+			inipp::extract(baseIni.sections["VERLET"]["domainsY"], domainsY);
+			if (bGPU || domainsX * domainsY > 1)
+				cout << "Sweep jobs run on the CPU in one process, bSimulateOnGPU and the domains are ignored" << endl;
+			int kernel = ForceKernelCells;
+			inipp::extract(baseIni.sections["VERLET"]["forceKernel"], kernel);
+			if (kernel == ForceKernelAuto)
+				cout << "Sweep jobs use the cell force kernel, a timed one could change between jobs" << endl;
+		}
+
+		// Cartesian product, the last axis changes fastest
+		jobs.clear();
+		std::vector<size_t> digit(axes.size(), 0);
+		for (;;)
+		{
+			Job job;
+			job.id = int(jobs.size());
+			for (size_t a = 0; a < axes.size(); ++a)
+				job.values.push_back(axes[a].values[digit[a]]);
+			inipp::Ini<char> ini = JobIni(job);
+			job.cost = EstimateCost(ini);
+			jobs.push_back(job);
+
+			int a = int(axes.size()) - 1;
+			while (a >= 0 && ++digit[a] == axes[a].values.size())
+				digit[a--] = 0;
+			if (a < 0)
+				break;
+		}
+		LoadCheckpoint();
+		nThreads = ResolveThreadCount(nThreads);
+		cout << "Sweep of " << jobs.size() << " jobs over " << axes.size() << " axes on " << nThreads << " threads" << endl;
+		return true;
+	}
+
+	// Longest jobs first onto whichever thread frees up, the usual greedy packing
+	void Run()
+	{
+		std::vector<int> order;
+		for (const Job& job : jobs)
+			if (!job.bDone)
+				order.push_back(job.id);
+		std::stable_sort(order.begin(), order.end(),
+			[this](int a, int b) { return jobs[a].cost > jobs[b].cost; });
+
+		std::ofstream checkpoint(checkpointFilename, std::ios::app);
+		const int nPending = int(order.size());
+		int nFinished = 0;
+#pragma omp parallel for num_threads(nThreads) schedule(dynamic, 1)
+		for (int k = 0; k < nPending; ++k)
+		{
+			// One job per thread, regions inside the simulator are nested and get one thread
+			omp_set_num_threads(1);
+			Job& job = jobs[order[k]];
+			RunJob(job);
+#pragma omp critical(SweepCheckpoint)
+			{
+				job.bDone = true;
+				checkpoint << CheckpointLine(job) << std::endl;
+				cout << "Job " << job.id << " done, " << ++nFinished << " of " << nPending << endl;
+			}
+		}
+		WriteTable();
+	}
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+
+// Static plan plus stealing: tasks are dealt longest-first to the least loaded queue,
+// then every thread drains its own queue and moves on to the others' leftovers.
+// Plan()/Reset() run on one thread, Run() on all of them, with barriers in between.
+class WorkStealingScheduler
+{
+	struct alignas(64) Queue
+	{
+		std::atomic<int> next;
+		int begin = 0;
+		int end = 0;
+	};
+
+	std::unique_ptr<Queue[]> queues;
+	int nQueues = 0;
+	int capacity = 0;
+
+	std::vector<int> order;
+	std::vector<int> byCost;
+	std::vector<int> taskQueue;
+	std::vector<int> queueFill;
+	std::vector<double> load;
+
+public:
+	void Plan(const std::vector<double>& costs, int nTasks, int numQueues)
+	{
+		if (numQueues > capacity)
+		{
+			queues.reset(new Queue[numQueues]);
+			capacity = numQueues;
+		}
+		nQueues = (std::max)(1, numQueues);
+
+		byCost.resize(nTasks);
+		std::iota(byCost.begin(), byCost.end(), 0);
+		std::sort(byCost.begin(), byCost.end(),
+			[&costs](int a, int b) { return costs[a] > costs[b]; });
+
+		load.assign(nQueues, 0.0);
+		queueFill.assign(nQueues + 1, 0);
+		taskQueue.resize(nTasks);
+		for (int task : byCost)
+		{
+			int q = int(std::min_element(load.begin(), load.end()) - load.begin());
+			load[q] += costs[task];
+			taskQueue[task] = q;
+			++queueFill[q + 1];
+		}
+		for (int q = 0; q < nQueues; ++q)
+			queueFill[q + 1] += queueFill[q];
+		for (int q = 0; q < nQueues; ++q)
+		{
+			queues[q].begin = queueFill[q];
+			queues[q].end = queueFill[q + 1];
+		}
+
+		// Inside a queue the most expensive tasks come first
+		order.resize(nTasks);
+		for (int task : byCost)
+			order[queueFill[taskQueue[task]]++] = task;
+		Reset();
+	}
+	// Replays the same plan, e.g. for a second pass over the same cells
+	void Reset()
+	{
+		for (int q = 0; q < nQueues; ++q)
+			queues[q].next.store(queues[q].begin, std::memory_order_relaxed);
+	}
+
+	template<typename Fn>
+	void Run(int thread, Fn&& fn)
+	{
+		for (int k = 0; k < nQueues; ++k)
+		{
+			Queue& q = queues[(thread + k) % nQueues];
+			for (int idx = q.next.fetch_add(1, std::memory_order_relaxed); idx < q.end;
+				idx = q.next.fetch_add(1, std::memory_order_relaxed))
+				fn(order[idx]);
+		}
+	}
+
+	int NumQueues() const { return nQueues; }
+	double Load(int queue) const { return load[queue]; }
+};
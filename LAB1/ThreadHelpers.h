@@ -0,0 +1,69 @@
+#pragma once
+#include <vector>
+#include <omp.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// 0 or less means "whatever OpenMP would use by default"
+inline int ResolveThreadCount(int requested)
+{
+	return requested > 0 ? requested : omp_get_max_threads();
+}
+
+inline bool PinCurrentThread(int core)
+{
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (core % 64)) != 0;
+#else
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(core % CPU_SETSIZE, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+}
+
+// OpenMP keeps its worker threads alive between parallel regions,
+// so pinning them once holds for every later region of the same size
+inline int PinWorkerThreads(int nThreads)
+{
+	int nPinned = 0;
+#pragma omp parallel num_threads(nThreads) reduction(+:nPinned)
+	nPinned += PinCurrentThread(omp_get_thread_num()) ? 1 : 0;
+	return nPinned;
+}
+
+// One value per thread, each on its own cache line.
+// Used for reductions OpenMP 2.0 can't do by itself (max) inside a running region
+template<typename T>
+class ThreadPartials
+{
+	struct alignas(64) Slot { T value; };
+	std::vector<Slot> slots;
+
+public:
+	void Resize(int nThreads) { slots.assign(nThreads, Slot{ T() }); }
+	int Size() const { return int(slots.size()); }
+
+	T& operator[](int thread) { return slots[thread].value; }
+	const T& operator[](int thread) const { return slots[thread].value; }
+
+	T Max(int nThreads) const
+	{
+		T result = slots[0].value;
+		for (int t = 1; t < nThreads; ++t)
+			if (slots[t].value > result)
+				result = slots[t].value;
+		return result;
+	}
+	T Sum(int nThreads) const
+	{
+		T result = slots[0].value;
+		for (int t = 1; t < nThreads; ++t)
+			result += slots[t].value;
+		return result;
+	}
+};
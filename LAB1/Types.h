@@ -2,6 +2,7 @@
 #include <memory>
 #include <vector>
 #include "GL/freeglut.h"
+#include "MemoryHelpers.h"
 
 template<typename T>
 struct Limits 
@@ -85,6 +86,39 @@ __forceinline Vector2<T> operator - (const Vector2<T>& a, const Vector2<T>& b)
 typedef Vector2<double> Vector2d;
 typedef Vector2<float> Vector2f;
 
+// Kahan summation, for running totals that take many small terms, like the simulated time.
+// The project builds with /fp:fast, which may fold the compensation to 0, so this one is precise.
+// The steps that cancel also go through memory, for instantiations and compilers the pragma
+// doesn't reach: without that, -ffast-math still turns (t - sum) - y into t - t
+#ifdef _MSC_VER
+#pragma float_control(precise, on, push)
+#endif
+template<typename T>
+struct CompensatedSum
+{
+	T sum = 0;
+	T compensation = 0;
+
+	void Add(T value)
+	{
+		const T y = value - compensation;
+		const volatile T t = sum + y;
+		const volatile T lost = t - sum;
+		compensation = lost - y;
+		sum = t;
+	}
+	CompensatedSum<T>& operator = (T value)
+	{
+		sum = value;
+		compensation = 0;
+		return *this;
+	}
+	operator T() const { return sum; }
+};
+#ifdef _MSC_VER
+#pragma float_control(pop)
+#endif
+
 template<typename real>
 struct Component
 {
@@ -93,6 +127,10 @@ struct Component
 	Vector2<real> a;
 };
 
+// Particle storage is page-allocated, placement follows whichever thread touches it first
+template<typename real>
+using ComponentVector = PageVector<Component<real>>;
+
 struct GLContext 
 {
 	HGLRC hgrlc;
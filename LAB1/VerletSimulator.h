@@ -5,8 +5,11 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <filesystem>
 #include <map>
+#include <memory>
+#include <algorithm>
 #include "ISimulator.h"
 #include "Types.h"
 #include "inipp.h"
@@ -14,17 +17,38 @@
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include "GLHelpers.h"
+#include "ThreadHelpers.h"
+#include "CellGrid.h"
+#include "TaskScheduler.h"
+#include "DomainDecomposition.h"
+#include "Integrators.h"
+#include "StructureAccumulator.h"
+#include "MultipleTauCorrelator.h"
+#include "ConcurrentUnionFind.h"
+#include "ObservableScheduler.h"
+#include "BlockAverager.h"
+#include "StatsRegistry.h"
+#include "FieldAccumulator.h"
 
-template<typename real>
+// accum is what sums over particles, pairs and steps are kept in, real float with accum double
+// keeps float arithmetic in the kernels
+template<typename real, typename accum = double>
 struct VerletProperties
 {
 	int N;
 	real Lx, Ly, dt, dt2;
-	real virial, xFlux, yFlux, pe, ke, _time;
+	real xFlux, yFlux;
+	accum virial, pe, ke;
+	// One step at a time, with dt changing every step
+	CompensatedSum<accum> _time;
 	real sigma = 1.0;
 	real epsilon = 4.0;
 	real collisionRadiusThreshold = 0.95;
 	real initPoxScale = 0.5;
+	// In units of sigma, 0 means every pair interacts
+	real cutoffRadius = 0;
+	// HugePageMode for particle and force arrays
+	int hugePages = 0;
 
 	int nAvg, nSet;
 	int bUseAdaptiveTimeStep = true;
@@ -33,14 +57,93 @@ struct VerletProperties
 	int edgeCondition = 0;
 	real ATSPathThreshold = 0.00015;
 	real explosionProtectionThreshold = 50.0;
+	// IntegratorType, the GPU path is always velocity Verlet
+	int integrator = 0;
+	// r-RESPA: forces beyond respaRadius (in units of sigma) are applied every respaSteps steps of dt,
+	// 1 turns it off
+	int respaSteps = 1;
+	real respaRadius = 2.0;
+	// Block time steps: particles step at dt times 1, 2, 4 .. 2^(timeStepLevels - 1) by their own
+	// acceleration and velocity, dt being the finest step. 1 turns it off
+	int timeStepLevels = 1;
+	// Energy feedback on dt: every energyDriftWindow updates, dt grows while |dE| / T per unit
+	// of time stayed under energyDriftBudget, and is halved when it didn't. 0 turns it off
+	real energyDriftBudget = 0;
+	int energyDriftWindow = 10;
+	// FIRE relaxation of the generated positions before the first step, 0 steps turns it off.
+	// Stops early once no particle feels more than minimizeForceTolerance
+	int minimizeSteps = 0;
+	real minimizeForceTolerance = 0.1;
+	// ForceKernel of the full-range force passes. -1 times them at Initialize() and keeps the fastest,
+	// which may differ from one run to the next, and each kernel adds the pair forces in its own order
+	int forceKernel = 0;
+	// In units of sigma, how far past cutoffRadius the neighbour list looks
+	real neighbourSkin = 0.3;
+	// Hits double/triple from every collisionStride-th step, 0 turns them off
+	int collisionStride = 1;
+	// g(r) from the pairs of every structureStride-th measured force pass, 0 turns it off.
+	// It reaches structureRadius sigma, or the cutoff or half the box if that's shorter.
+	// S(k) over the box's k-grid up to structureModes in each direction, 0 leaves it out
+	int structureStride = 0;
+	int structureBins = 200;
+	real structureRadius = 0;
+	int structureModes = 0;
+	std::string structureFilename;
+	// MSD and velocity autocorrelation from a sample every correlatorStride steps, 0 turns them off.
+	// correlatorPoints lags per level, each level half as fine as the one before
+	int correlatorStride = 0;
+	int correlatorPoints = 16;
+	int correlatorLevels = 20;
+	std::string correlatorFilename;
+	// Updates between rewrites of structureFilename and correlatorFilename, 0 only writes them
+	// when WriteOutputs() is called
+	int outputStride = 100;
+	// Stats that get block averages, comma separated, "none" for no averages. They're only taken
+	// after averageWarmup updates. The run stops once targetObservable's error is under targetError, 0 keeps it going
+	std::string averagedStats;
+	int averageWarmup = 0;
+	real targetError = 0;
+	std::string targetObservable;
+	// Clusters of particles joined by the contacts CountCollisions() finds, every clusterStride-th
+	// step, 0 turns them off
+	int clusterStride = 0;
+	// Density, flow and temperature on a fieldBinsX x fieldBinsY grid from the measured kick of every
+	// fieldStride-th step, 0 turns them off. The grid reaches fieldEscape past Lx to follow what
+	// leaves the box, at most the 0.05 Lx the hole-in-a-box modes keep moving a particle for.
+	// Each update's average is appended to fieldFilename as a frame
+	int fieldStride = 0;
+	int fieldBinsX = 32;
+	int fieldBinsY = 32;
+	real fieldEscape = 0;
+	std::string fieldFilename;
 
 	long long collisionsNum = 0;
 	long long doubleCollisions = 0;
 	long long tripleCollisions = 0;
+	long long forceEvaluations = 0;
+	// E of the first Update(), the drift is measured against it
+	real initialEnergy = 0;
+	bool bHaveInitialEnergy = false;
 
 	int numInBox = 0;
+	// Particles [0, nActive) are still in play, the tail holds the ones that escaped the box
+	int nActive = 0;
 
 	real cumulativeForce = 0;
+
+	int nThreads = 0;
+	int bPinThreads = false;
+
+	// Process grid, more than one domain needs cutoffRadius and VERLET_RANK for every process.
+	// SourceDomains.cpp runs a rank without a window. The sockets go to domainSocketPath.<rank>,
+	// in the temp directory if it is empty
+	int domainsX = 1;
+	int domainsY = 1;
+	std::string domainSocketPath;
+	// Ghosts of other ranks' particles follow the owned ones, [nActive, nActive + nGhost)
+	int nGhost = 0;
+	// 0 picks a fresh one every run
+	int seed = 0;
 };
 
 struct VerletGPUProperties
@@ -59,15 +162,141 @@ struct VerletGPUProperties
 	int Nrad32;
 };
 
-template<typename real>
-class VerletSimulator : private VerletProperties<real>, private VerletGPUProperties, virtual public ISimulator<real>
+template<typename real, typename accum = double>
+class VerletSimulator : private VerletProperties<real, accum>, private VerletGPUProperties, virtual public ISimulator<real>
 {
 private:
-	std::vector<Component<real>> comps;
-	std::map<std::string, real> stats;
+	ComponentVector<real> comps;
+	// Registered in SetupStats(), the updates only write through the handles
+	StatsRegistry<real> stats;
+	struct StatHandles
+	{
+		int E, T, pFlux, pvirial, time, hitsDouble, hitsTriple, inBox, EDrift, forceEvals, dtScale;
+		int gPeak, gPeakR, D, largestCluster, clusters;
+	} handles = {};
+
+	// Per-thread force accumulators, pair forces go to both particles without races.
+	// Forces are computed in real and summed in accum
+	std::vector<PageVector<Vector2<accum>>> threadAccel;
+	ThreadPartials<real> threadMaxV, threadMaxA;
+
+	SplittingScheme<real> scheme;
+	// Potential of force evaluations that aren't measured
+	accum peUnmeasured = 0;
+	// Far part of the forces under r-RESPA, valid from one far pass until the next drift
+	PageVector<Vector2<real>> farAccel;
+	// Set by the energy feedback, scales whatever dt AdjustTimeStep() or the config gives
+	real dtScale = 1;
+	real configDt = 0;
+	int windowUpdates = 0;
+	real windowStartE = 0;
+	real windowStartTime = 0;
+	// _time when the current Update() started, the flux is over the time it actually covered
+	accum updateStartTime = 0;
+	// The measured kicks fill threadMaxV/threadMaxA from the first step on
+	bool bHaveStepMaxima = false;
+	// Level of every particle under block time steps, and the substep the current force pass is at
+	PageVector<int> stepLevel;
+	int blockBoundary = 0;
+
+	// Force and collision passes run over cells of a grid as scheduler tasks.
+	// Pairs found by the last pass over the cells go into planning the next one
+	struct CellPass
+	{
+		CellGrid<real> grid;
+		WorkStealingScheduler tasks;
+		std::vector<double> costs;
+		std::vector<int> pairs;
+	};
+	CellPass cells;
+	// RESPA near passes get their own finer cells, sized to respaRadius
+	CellPass nearCells;
+	// Neighbour list: the pairs every cell of listCells found at the last rebuild, and where
+	// each particle was then
+	CellPass listCells;
+	std::vector<std::vector<std::pair<int, int>>> listPairs;
+	std::vector<Vector2<real>> listOrigins;
+	// Set whenever particles are reordered, the list is rebuilt by the next pass
+	bool bListStale = true;
+	bool bRebuildList = false;
+	ThreadPartials<real> threadMaxMove;
+	// All-pairs kernel, one task per row of tiles. 64 particles of a tile plus its forces stay in L1
+	static const int ForceTileSize = 64;
+	WorkStealingScheduler tileTasks;
+	std::vector<double> tileCosts;
+	PageVector<int> collisionCounts;
+
+	// Everything measured besides the energy goes by its own stride, the steps only do the work
+	// of the ones that are due
+	ObservableScheduler observables;
+	int obsEnergy = 0, obsCollisions = 0, obsStructure = 0, obsModes = 0, obsCorrelator = 0, obsClusters = 0, obsFields = 0;
+	bool bCountPass = false;
+
+	StructureAccumulator<real> structure;
+	// Positions of a sampled pass and the rho(k) worked out from them off the step loop
+	struct ModeSnapshot
+	{
+		std::vector<Vector2<real>> positions;
+		std::vector<double> rho;
+		int count = 0;
+	};
+	std::vector<std::shared_ptr<ModeSnapshot>> modeSnapshots;
+	std::map<std::string, std::vector<real>> profiles;
+	// One per name in averagedStats, in that order
+	struct AveragedStat
+	{
+		std::string name;
+		BlockAverager blocks;
+		// The stat itself, -1 if there's no such stat, and where its mean and error go
+		int source = -1, mean = 0, error = 0;
+	};
+	std::vector<AveragedStat> averages;
+	int updatesDone = 0;
+	std::vector<double> structureMerged;
+	// Steps since Initialize(), the samplers below go by it
+	long long stepsTaken = 0;
+	// Whether the running pass bins its pairs
+	bool bStructurePass = false;
+	// Binned by the measured kick after a force pass that sets bFieldPass
+	FieldAccumulator<real> fields;
+	std::vector<double> fieldsMerged;
+	bool bFieldPass = false;
+	// Indexed by generation index. Positions with the periodic wraps taken out, and where each
+	// particle was at the last sample, the wraps since are recovered from the move in between
+	MultipleTauCorrelator<real> correlator;
+	PageVector<Vector2<double>> unwrapped;
+	PageVector<Vector2<real>> lastSampled;
+	bool bCorrelateNow = false;
+	// Time of the last sample, and the fastest particle of this one per thread. Anyone faster
+	// than half the box per gap may have wrapped without it showing, that's said once
+	double lastCorrelateTime = 0;
+	double correlateGap = 0;
+	ThreadPartials<real> threadSampleV;
+	bool bUnwrapWarned = false;
+	// Contacts of a sampled CountCollisions() go into the forest, sizes are counted on the roots
+	ConcurrentUnionFind clusters;
+	PageVector<int> clusterSizes;
+	bool bClusterPass = false;
+	// Clusters per power-of-two size bin, the largest and the count, summed over the samples
+	// of the current update
+	std::vector<std::vector<double>> threadClusterBins;
+	ThreadPartials<int> threadLargestCluster;
+	static const int ClusterSizeBins = 32;
+	double largestClusterSum = 0;
+	double clusterCountSum = 0;
+	int clusterSamples = 0;
+
+	// Index a particle had at generation, travels with it through compaction and migration
+	std::vector<int> globalIds;
+	DomainDecomposition<real> domains;
 
 	std::uniform_real_distribution<real> random = std::uniform_real_distribution<real>(real(-1.0), real(1.0));
 	std::random_device rd;
+	std::mt19937 rng;
+	// Set through SetSeed(), wins over the seed key
+	unsigned int seedOverride = 0;
+	// Set through SetOutputSuffix(), goes before the extension of every file written
+	std::string outputSuffix;
 
 	void InitPosCPU(int nRow, real vMax)
 	{
@@ -84,8 +313,8 @@ private:
 			{
 				comps[i].p.y = ay * (iy + real(0.5)) * initPoxScale;
 				comps[i].p.x = ax * (ix + real(0.5)) * initPoxScale;
-				vxSum += (comps[i].v.x = random(rd) * vMax);
-				vySum += (comps[i].v.y = random(rd) * vMax);
+				vxSum += (comps[i].v.x = random(rng) * vMax);
+				vySum += (comps[i].v.y = random(rng) * vMax);
 				++i;
 				if (i >= N)
 					goto cycleBreak;
@@ -173,6 +402,41 @@ private:
 		
 		glGenVertexArrays(1, &vao);
 	}
+	// Nothing here is written by a single thread, so every page ends up
+	// on the node of the thread that works on it later
+	void AllocateParticleArrays()
+	{
+		comps = ComponentVector<real>(N, PageAllocator<Component<real>>(hugePages));
+		FirstTouch(comps, nThreads);
+		collisionCounts = PageVector<int>(N, PageAllocator<int>(hugePages));
+		FirstTouch(collisionCounts, nThreads);
+		farAccel = PageVector<Vector2<real>>(RespaActive() ? N : 0, PageAllocator<Vector2<real>>(hugePages));
+		FirstTouch(farAccel, nThreads);
+		stepLevel = PageVector<int>(BlockStepsActive() ? N : 0, PageAllocator<int>(hugePages));
+		FirstTouch(stepLevel, nThreads);
+		globalIds.resize(N);
+		for (int i = 0; i < N; ++i)
+			globalIds[i] = i;
+
+		threadAccel.resize(nThreads);
+#pragma omp parallel num_threads(nThreads)
+		{
+			PageVector<Vector2<accum>>& acc = threadAccel[omp_get_thread_num()];
+			acc = PageVector<Vector2<accum>>(N, PageAllocator<Vector2<accum>>(hugePages));
+			for (int i = 0; i < N; ++i)
+				acc[i] = { 0.0, 0.0 };
+		}
+		// In case OpenMP handed out a smaller team than asked for
+		for (auto& acc : threadAccel)
+			if (int(acc.size()) != N)
+				acc = PageVector<Vector2<accum>>(N, Vector2<accum>{ 0.0, 0.0 }, PageAllocator<Vector2<accum>>(hugePages));
+
+		std::vector<std::pair<const void*, size_t>> accelRanges;
+		for (auto& acc : threadAccel)
+			accelRanges.push_back(std::make_pair((const void*)acc.data(), acc.size() * sizeof(Vector2<accum>)));
+		ReportPlacement("Particles", comps.data(), comps.size() * sizeof(Component<real>));
+		ReportPlacement("Force buffers", accelRanges);
+	}
 	void InitializeConfig(const std::string& filename)
 	{
 		inipp::Ini<char> ini;
@@ -205,8 +469,114 @@ private:
 		InitializeValue("VERLET", "ATSPathThreshold", ATSPathThreshold, real(0.00015), ini);
 		InitializeValue("VERLET", "edgeCondition", edgeCondition, 0, ini);
 		InitializeValue("VERLET", "explosionProtectionThreshold", explosionProtectionThreshold, real(explosionProtectionThreshold), ini);
+		InitializeValue("VERLET", "cutoffRadius", cutoffRadius, real(0.0), ini);
+		InitializeValue("VERLET", "nThreads", nThreads, 0, ini);
+		InitializeValue("VERLET", "bPinThreads", bPinThreads, 0, ini);
+		InitializeValue("VERLET", "hugePages", hugePages, 0, ini);
+		InitializeValue("VERLET", "domainsX", domainsX, 1, ini);
+		InitializeValue("VERLET", "domainsY", domainsY, 1, ini);
+		InitializeValue("VERLET", "domainSocketPath", domainSocketPath, DefaultSocketPath(), ini);
+		InitializeValue("VERLET", "seed", seed, 0, ini);
+		InitializeValue("VERLET", "integrator", integrator, 0, ini);
+		InitializeValue("VERLET", "respaSteps", respaSteps, 1, ini);
+		InitializeValue("VERLET", "respaRadius", respaRadius, real(2.0), ini);
+		InitializeValue("VERLET", "timeStepLevels", timeStepLevels, 1, ini);
+		InitializeValue("VERLET", "energyDriftBudget", energyDriftBudget, real(0.0), ini);
+		InitializeValue("VERLET", "energyDriftWindow", energyDriftWindow, 10, ini);
+		InitializeValue("VERLET", "minimizeSteps", minimizeSteps, 0, ini);
+		InitializeValue("VERLET", "minimizeForceTolerance", minimizeForceTolerance, real(0.1), ini);
+		InitializeValue("VERLET", "forceKernel", forceKernel, 0, ini);
+		InitializeValue("VERLET", "neighbourSkin", neighbourSkin, real(0.3), ini);
+		InitializeValue("VERLET", "collisionStride", collisionStride, 1, ini);
+		InitializeValue("VERLET", "structureStride", structureStride, 0, ini);
+		InitializeValue("VERLET", "structureBins", structureBins, 200, ini);
+		InitializeValue("VERLET", "structureRadius", structureRadius, real(0.0), ini);
+		InitializeValue("VERLET", "structureModes", structureModes, 0, ini);
+		InitializeValue("VERLET", "structureFilename", structureFilename, std::string("structure.txt"), ini);
+		InitializeValue("VERLET", "outputStride", outputStride, 100, ini);
+		InitializeValue("VERLET", "correlatorStride", correlatorStride, 0, ini);
+		InitializeValue("VERLET", "correlatorPoints", correlatorPoints, 16, ini);
+		InitializeValue("VERLET", "correlatorLevels", correlatorLevels, 20, ini);
+		InitializeValue("VERLET", "correlatorFilename", correlatorFilename, std::string("correlations.txt"), ini);
+		InitializeValue("VERLET", "clusterStride", clusterStride, 0, ini);
+		InitializeValue("VERLET", "fieldStride", fieldStride, 0, ini);
+		InitializeValue("VERLET", "fieldBinsX", fieldBinsX, 32, ini);
+		InitializeValue("VERLET", "fieldBinsY", fieldBinsY, 32, ini);
+		InitializeValue("VERLET", "fieldEscape", fieldEscape, real(0.0), ini);
+		InitializeValue("VERLET", "fieldFilename", fieldFilename, std::string("fields.bin"), ini);
+		InitializeValue("VERLET", "averagedStats", averagedStats, std::string("E, T, pvirial, In box"), ini);
+		InitializeValue("VERLET", "averageWarmup", averageWarmup, 0, ini);
+		InitializeValue("VERLET", "targetError", targetError, real(0.0), ini);
+		InitializeValue("VERLET", "targetObservable", targetObservable, std::string("E"), ini);
+		SetupAverages();
+		configDt = dt;
+		energyDriftWindow = (std::max)(1, energyDriftWindow);
+		if (energyDriftBudget > 0 && !ConservesEnergy())
+		{
+			cout << "This edgeCondition doesn't conserve energy, no energy feedback on dt" << endl;
+			energyDriftBudget = 0;
+		}
 
-		comps = std::vector<Component<real>>(N);
+		scheme = MakeSplittingScheme<real>(integrator);
+		cout << "Integrator: " << scheme.name << ", " << scheme.ForceEvaluations() << " force evaluations per step" << endl;
+		respaSteps = (std::max)(1, respaSteps);
+		if (RespaActive() && (respaRadius <= RespaHealingWidth() || (cutoffRadius > 0 && respaRadius >= cutoffRadius)))
+		{
+			cout << "respaRadius has to be above " << RespaHealingWidth() << " and below cutoffRadius, RESPA is off" << endl;
+			respaSteps = 1;
+		}
+		if (RespaActive())
+			cout << "RESPA: far forces every " << respaSteps << " steps, beyond " << respaRadius << " sigma" << endl;
+		const int maxTimeStepLevels = 16;
+		timeStepLevels = (std::max)(1, (std::min)(maxTimeStepLevels, timeStepLevels));
+		if (timeStepLevels > 1 && (integrator != IntegratorVelocityVerlet || RespaActive()))
+		{
+			cout << "Block time steps need integrator=0 and respaSteps=1, they are off" << endl;
+			timeStepLevels = 1;
+		}
+		if (bSimulateOnGPU && (integrator != IntegratorVelocityVerlet || RespaActive() || timeStepLevels > 1))
+			cout << "GPU simulation only has velocity Verlet" << endl;
+		if (forceKernel < ForceKernelAuto || forceKernel > ForceKernelNeighbourList)
+			forceKernel = ForceKernelAuto;
+		if (forceKernel == ForceKernelNeighbourList && cutoffRadius <= 0)
+		{
+			cout << "The neighbour list needs cutoffRadius, using cells" << endl;
+			forceKernel = ForceKernelCells;
+		}
+		neighbourSkin = (std::max)(real(0.0), neighbourSkin);
+
+		if (domainsX * domainsY > 1 && cutoffRadius <= 0)
+		{
+			cout << "Domain decomposition needs cutoffRadius, running undecomposed" << endl;
+			domainsX = domainsY = 1;
+		}
+		const int connectTimeoutSeconds = 60;
+		if (domains.Setup(domainsX, domainsY, domainSocketPath, connectTimeoutSeconds) && bSimulateOnGPU)
+		{
+			cout << "GPU simulation doesn't work with domain decomposition, using CPU" << endl;
+			bSimulateOnGPU = false;
+		}
+		// Levels would have to travel with migrating particles
+		if (domains.Active() && timeStepLevels > 1)
+		{
+			cout << "Block time steps don't work with domain decomposition, they are off" << endl;
+			timeStepLevels = 1;
+		}
+
+		nThreads = ResolveThreadCount(nThreads);
+		if (bPinThreads)
+			cout << "Pinned " << PinWorkerThreads(nThreads) << " of " << nThreads << " threads" << endl;
+
+		AllocateParticleArrays();
+		nActive = numInBox = N;
+		nGhost = 0;
+		threadMaxV.Resize(nThreads);
+		threadMaxA.Resize(nThreads);
+		threadMaxMove.Resize(nThreads);
+		SetupTaskGrid();
+		SetupStructure();
+		SetupClusters();
+		SetupFields();
 
 		int nRow;
 		real vMax;
@@ -214,11 +584,203 @@ private:
 		InitializeValue("VERLET", "vMax", vMax, real(0.5), ini);
 		InitializeValue("VERLET", "initPoxScale", initPoxScale, real(0.5), ini);
 
+		// Every rank has to draw the same configuration
+		double runSeed = seedOverride != 0 ? seedOverride : (seed != 0 ? unsigned(seed) : rd());
+		if (domains.Active())
+		{
+			if (domains.Rank() != 0)
+				runSeed = 0;
+			domains.Max(&runSeed, 1);
+		}
+		rng.seed(unsigned(runSeed));
+
 		InitPosCPU(nRow, vMax);
+		if (domains.Active())
+			KeepOwnedParticles();
+		if (minimizeSteps > 0)
+			Minimize();
 		if (bSimulateOnGPU)
 			InitGPU();
 
-		ini.generate(std::ofstream(filename));
+		// Ranks share the config file, one writer is enough
+		if (domains.Rank() == 0)
+			ini.generate(std::ofstream(filename));
+	}
+
+	// FIRE (Bitzek et al. 2006) on the generated lattice with the regular force passes and boundaries.
+	// The velocities InitPosCPU drew are put back afterwards, by generation index since
+	// decomposed runs migrate particles while relaxing
+	void Minimize()
+	{
+		std::vector<Vector2<real>> assigned(N);
+		for (int i = 0; i < nActive; ++i)
+		{
+			assigned[globalIds[i]] = comps[i].v;
+			comps[i].v = { 0.0, 0.0 };
+		}
+		if (domains.Active())
+			domains.ExchangeHalo(comps, globalIds, nActive, nGhost);
+
+		const int nDelay = 5;
+		const real dtGrow = 1.1;
+		const real dtShrink = 0.5;
+		const real alphaStart = 0.1;
+		const real alphaShrink = 0.99;
+		// No particle moves further than this per step, overlaps would otherwise throw them across the box
+		const real maxMove = real(0.1) * sigma;
+		// In units of sigma * sqrt(m / epsilon), larger steps keep a compressed lattice ringing
+		const real dtMax = real(0.02) * sigma;
+		real fireDt = real(0.1) * dtMax;
+		real alpha = alphaStart;
+		int nDownhill = 0;
+		int nSteps = 0;
+		real maxForce = 0;
+		bool bConverged = false;
+		real mixV = 0;
+		real mixF = 0;
+		double sums[] = { 0.0, 0.0, 0.0 };
+
+#pragma omp parallel num_threads(nThreads)
+		{
+			Accel(Vector2<real>{ Lx, Ly }, peUnmeasured);
+			for (int step = 0; ; ++step)
+			{
+				const int thread = omp_get_thread_num();
+				double powerLocal = 0;
+				double v2Local = 0;
+				double f2Local = 0;
+				real maxF2Local = 0;
+#pragma omp for schedule(static)
+				for (int i = 0; i < nActive; ++i)
+				{
+					const Component<real>& c = comps[i];
+					powerLocal += c.a * c.v;
+					v2Local += c.v.SizeSqr();
+					f2Local += c.a.SizeSqr();
+					maxF2Local = max(maxF2Local, c.a.SizeSqr());
+				}
+				threadMaxA[thread] = maxF2Local;
+#pragma omp atomic
+				sums[0] += powerLocal;
+#pragma omp atomic
+				sums[1] += v2Local;
+#pragma omp atomic
+				sums[2] += f2Local;
+#pragma omp barrier
+#pragma omp single
+				{
+					double globalMax = threadMaxA.Max(omp_get_num_threads());
+					domains.Sum(sums, 3);
+					domains.Max(&globalMax, 1);
+					maxForce = sqrt(real(globalMax));
+					nSteps = step;
+					bConverged = maxForce < minimizeForceTolerance || step >= minimizeSteps || domains.Failed();
+					if (sums[0] > 0)
+					{
+						// Steer along the force, more so the longer it keeps going downhill
+						mixV = real(1.0) - alpha;
+						mixF = sums[2] > 0 ? alpha * real(sqrt(sums[1] / sums[2])) : real(0);
+						if (++nDownhill > nDelay)
+						{
+							fireDt = min(fireDt * dtGrow, dtMax);
+							alpha *= alphaShrink;
+						}
+					}
+					else
+					{
+						mixV = mixF = 0;
+						fireDt *= dtShrink;
+						alpha = alphaStart;
+						nDownhill = 0;
+					}
+					sums[0] = sums[1] = sums[2] = 0;
+				}
+				if (bConverged)
+					break;
+
+#pragma omp for schedule(static)
+				for (int i = 0; i < nActive; ++i)
+				{
+					Component<real>& c = comps[i];
+					c.v = mixV * c.v + mixF * c.a;
+					c.v += real(0.5) * fireDt * c.a;
+					const real move = c.v.Size() * fireDt;
+					if (move > maxMove)
+						c.v = c.v * (maxMove / move);
+					Drift(c, fireDt);
+				}
+#pragma omp single
+				{
+					CompactActive();
+					if (domains.Active())
+						ExchangeParticles();
+				}
+				Accel(Vector2<real>{ Lx, Ly }, peUnmeasured);
+#pragma omp for schedule(static)
+				for (int i = 0; i < nActive; ++i)
+					comps[i].v += real(0.5) * fireDt * comps[i].a;
+			}
+		}
+
+		for (int i = 0; i < nActive; ++i)
+			comps[i].v = assigned[globalIds[i]];
+		cout << "FIRE: " << nSteps << " steps, largest force left " << maxForce << endl;
+	}
+	// A few timed passes of every kernel that fits. The neighbour list is charged its rebuild
+	// spread over the steps the skin lasts at the fastest particle's speed
+	void SelectForceKernel()
+	{
+		const char* names[] = { "cells", "all pairs", "neighbour list" };
+		const int range = RespaActive() ? ForcesFar : ForcesAll;
+		const int nPasses = 3;
+		std::vector<int> kernels(1, ForceKernelCells);
+		if (cutoffRadius > 0 && !domains.Active())
+			kernels.push_back(ForceKernelNeighbourList);
+		// Each particle meets every other one instead of the 9 cells around it,
+		// on a fine grid that's not worth timing
+		const int maxAllPairsCells = 16 * 9;
+		if (cutoffRadius <= 0 || cells.grid.NumCells() <= maxAllPairsCells)
+			kernels.push_back(ForceKernelAllPairs);
+
+		real vMax2 = 0;
+		for (int i = 0; i < nActive; ++i)
+			vMax2 = max(vMax2, comps[i].v.SizeSqr());
+		const double travel = sqrt(double(vMax2)) * dt;
+		const double stepsPerBuild = travel > 0 ? (std::min)(1000.0, (std::max)(1.0, 0.5 * neighbourSkin * sigma / travel)) : 1000.0;
+
+		double bestTime = (std::numeric_limits<double>::max)();
+		int bestKernel = ForceKernelCells;
+		cout << "Force kernels:";
+		for (int kernel : kernels)
+		{
+			forceKernel = kernel;
+			bListStale = true;
+			auto start = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(nThreads)
+			Accel(Vector2r{ Lx, Ly }, peUnmeasured, range);
+			const double firstPass = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			double passTime = firstPass;
+			// Far behind already, the other passes won't change that
+			if (firstPass < 4 * bestTime)
+			{
+				start = std::chrono::steady_clock::now();
+#pragma omp parallel num_threads(nThreads)
+				for (int k = 0; k < nPasses; ++k)
+					Accel(Vector2r{ Lx, Ly }, peUnmeasured, range);
+				passTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / nPasses;
+				if (kernel == ForceKernelNeighbourList)
+					passTime += (std::max)(0.0, firstPass - passTime) / stepsPerBuild;
+			}
+			cout << (kernel == kernels.front() ? " " : ", ") << names[kernel] << " " << passTime * 1000 << " ms";
+			if (passTime < bestTime)
+			{
+				bestTime = passTime;
+				bestKernel = kernel;
+			}
+		}
+		forceKernel = bestKernel;
+		bListStale = true;
+		cout << ", using " << names[forceKernel] << endl;
 	}
 
 	void Transport_HoleInABox(Vector2<real>& P, Vector2<real>& flux,
@@ -365,6 +927,290 @@ private:
 			V.y = -abs(V.y);
 	}
 
+	// Hole-in-a-box modes never let a particle back once it passed the outer wall
+	bool CompactsEscaped() const
+	{
+		switch (edgeCondition)
+		{ case 3: case 4: case 5: return true; }
+		return false;
+	}
+	void SwapParticles(int i, int j)
+	{
+		std::swap(comps[i], comps[j]);
+		std::swap(globalIds[i], globalIds[j]);
+		if (!stepLevel.empty())
+			std::swap(stepLevel[i], stepLevel[j]);
+		bListStale = true;
+	}
+	// Moves escaped particles behind nActive so that no kernel touches them again
+	void CompactActive()
+	{
+		if (!CompactsEscaped())
+			return;
+		const real escapeX = Lx * real(1.05);
+		for (int i = 0; i < nActive;)
+		{
+			if (comps[i].p.x >= escapeX)
+			{
+				comps[i].a = { 0.0, 0.0 };
+				SwapParticles(i, --nActive);
+			}
+			else
+				++i;
+		}
+		numInBox = nActive;
+	}
+
+	// Which directions Separation() treats as periodic
+	bool WrapsX() const
+	{
+		switch (edgeCondition)
+		{ case 2: case 3: case 4: case 6: return false; }
+		return true;
+	}
+	bool WrapsY() const
+	{
+		switch (edgeCondition)
+		{ case 1: case 2: case 3: case 6: return false; }
+		return true;
+	}
+	void SetupTaskGrid()
+	{
+		const real rc = cutoffRadius * sigma;
+		if (rc > 0)
+		{
+			if (rc > real(0.5) * min(Lx, Ly) && (WrapsX() || WrapsY()))
+				cout << "cutoffRadius is over half the box, periodic images will be missed" << endl;
+			cells.grid.SetupNeighbourhood(Vector2<real>{ Lx, Ly }, max(rc, collisionRadiusThreshold * sigma), WrapsX(), WrapsY());
+		}
+		else
+		{
+			// No cutoff: blocks only exist to split the work, a few per thread
+			int nBlocks = int(ceil(sqrt(8.0 * nThreads)));
+			cells.grid.SetupAllPairs(Vector2<real>{ Lx, Ly }, nBlocks, nBlocks);
+		}
+		cells.pairs.assign(cells.grid.NumCells(), 0);
+		cells.costs.assign(cells.grid.NumCells(), 0.0);
+		if (RespaActive())
+		{
+			nearCells.grid.SetupNeighbourhood(Vector2<real>{ Lx, Ly }, respaRadius * sigma, WrapsX(), WrapsY());
+			nearCells.pairs.assign(nearCells.grid.NumCells(), 0);
+			nearCells.costs.assign(nearCells.grid.NumCells(), 0.0);
+		}
+		if (rc > 0)
+		{
+			listCells.grid.SetupNeighbourhood(Vector2<real>{ Lx, Ly }, rc + neighbourSkin * sigma, WrapsX(), WrapsY());
+			listCells.pairs.assign(listCells.grid.NumCells(), 0);
+			listCells.costs.assign(listCells.grid.NumCells(), 0.0);
+			listPairs.assign(listCells.grid.NumCells(), std::vector<std::pair<int, int>>());
+		}
+		bListStale = true;
+
+		// Ghosts have to cover both the force and the collision range.
+		// The grid still spans the whole box, cells away from our domain just stay empty
+		domains.SetGeometry(Vector2<real>{ Lx, Ly }, WrapsX(), WrapsY(), max(rc, collisionRadiusThreshold * sigma));
+	}
+	void SetupStructure()
+	{
+		if (structureStride > 0 && bSimulateOnGPU)
+			cout << "The GPU path doesn't sample g(r)" << endl;
+		const real rc = cutoffRadius * sigma;
+		real rMax = real(0.5) * min(Lx, Ly);
+		if (structureRadius > 0)
+			rMax = min(rMax, structureRadius * sigma);
+		if (rc > 0)
+			rMax = min(rMax, rc);
+		const bool bSample = structureStride > 0 && !bSimulateOnGPU;
+		structure.Setup(nThreads, bSample ? structureBins : 0, rMax, structureModes, Vector2<real>{ Lx, Ly });
+		modeSnapshots.clear();
+		profiles.clear();
+	}
+	void SetupAverages()
+	{
+		averages.clear();
+		for (const std::string& name : SplitList(averagedStats))
+			if (name != "none")
+			{
+				averages.push_back(AveragedStat());
+				averages.back().name = name;
+			}
+		updatesDone = 0;
+		if (targetError > 0 && !AveragesStat(targetObservable))
+		{
+			cout << targetObservable << " isn't in averagedStats, the run won't stop by itself" << endl;
+			targetError = 0;
+		}
+	}
+	bool AveragesStat(const std::string& name) const
+	{
+		for (const AveragedStat& average : averages)
+			if (average.name == name)
+				return true;
+		return false;
+	}
+	// After every sampler decided whether it can run. The energy is always taken, it rides
+	// along the kicks and the force pass and AdjustTimeStep() uses what that pass finds
+	void SetupObservables()
+	{
+		observables.Clear();
+		obsEnergy = observables.Register("energy", 1, ObservableFused);
+		obsCollisions = observables.Register("collisions", bSimulateOnGPU ? 0 : collisionStride, ObservablePass);
+		obsStructure = observables.Register("g(r)", structure.Enabled() ? structureStride : 0, ObservableFused);
+		obsModes = observables.Register("S(k)", structure.ModesEnabled() ? structureStride : 0, ObservableSnapshot);
+		obsCorrelator = observables.Register("MSD/VACF", correlator.Enabled() ? correlatorStride : 0, ObservablePass);
+		obsClusters = observables.Register("clusters", clusterStride, ObservablePass);
+		obsFields = observables.Register("fields", fields.Enabled() ? fieldStride : 0, ObservableFused);
+		observables.Report();
+	}
+	// After SetupObservables(), a stat is only there if whatever measures it is on
+	void SetupStats()
+	{
+		stats.Clear();
+		handles.E = stats.Register("E");
+		handles.T = stats.Register("T");
+		handles.pFlux = stats.Register("pFlux");
+		handles.pvirial = stats.Register("pvirial");
+		handles.time = stats.Register("Time");
+		if (observables.Enabled(obsCollisions))
+		{
+			handles.hitsDouble = stats.Register("Hits double");
+			handles.hitsTriple = stats.Register("Hits triple");
+		}
+		handles.inBox = stats.Register("In box");
+		handles.EDrift = stats.Register("E drift");
+		handles.forceEvals = stats.Register("Force evals");
+		if (energyDriftBudget > 0)
+			handles.dtScale = stats.Register("dt scale");
+		if (structure.Enabled())
+		{
+			handles.gPeak = stats.Register("g(r) peak");
+			handles.gPeakR = stats.Register("g(r) peak r");
+		}
+		if (observables.Enabled(obsCorrelator))
+			handles.D = stats.Register("D");
+		if (observables.Enabled(obsClusters))
+		{
+			handles.largestCluster = stats.Register("Largest cluster");
+			handles.clusters = stats.Register("Clusters");
+		}
+		for (AveragedStat& average : averages)
+		{
+			average.source = stats.Find(average.name);
+			average.mean = stats.Register(average.name + " mean");
+			average.error = stats.Register(average.name + " error");
+		}
+	}
+	// Clusters across a domain border would need the other rank's forest
+	void SetupClusters()
+	{
+		if (clusterStride > 0 && (bSimulateOnGPU || domains.Active()))
+		{
+			cout << "Cluster sizes need a CPU run without domain decomposition, they are off" << endl;
+			clusterStride = 0;
+		}
+		const int n = clusterStride > 0 ? N : 0;
+		clusters.Resize(n);
+		clusterSizes = PageVector<int>(n, PageAllocator<int>(hugePages));
+		FirstTouch(clusterSizes, nThreads);
+		threadClusterBins.assign(nThreads, std::vector<double>(ClusterSizeBins, 0.0));
+		threadLargestCluster.Resize(nThreads);
+		largestClusterSum = clusterCountSum = 0;
+		clusterSamples = 0;
+	}
+	// The kicks the fields ride on don't run on the GPU. Every rank bins its own particles on
+	// the same grid over the whole box, the bins are summed before a frame is written
+	void SetupFields()
+	{
+		bool bFields = fieldStride > 0;
+		if (bFields && bSimulateOnGPU)
+		{
+			cout << "Fields need a CPU run, they are off" << endl;
+			bFields = false;
+		}
+		// CompactActive() stops a particle at 1.05 Lx and no pass sees it again, bins past that stay empty
+		real escape = (std::max)(real(0), fieldEscape);
+		if (bFields && CompactsEscaped() && escape > real(0.05) * Lx)
+		{
+			escape = real(0.05) * Lx;
+			cout << "fieldEscape is cut to " << escape << ", particles further out are no longer simulated" << endl;
+		}
+		fields.Setup(nThreads, bFields ? fieldBinsX : 0, fieldBinsY, Vector2<real>{ 0, 0 }, Vector2<real>{ Lx + escape, Ly });
+		bFieldPass = false;
+		const std::string filename = OutputName(fieldFilename);
+		if (fields.Enabled() && domains.Rank() == 0 && !filename.empty() && !fields.Open(filename))
+			cout << "Can't write " << filename << ", fields are only averaged" << endl;
+	}
+	// After the positions are final. A decomposed run would have to send the history along
+	// with every migrating particle, so there is none
+	void SetupCorrelator()
+	{
+		bool bCorrelate = correlatorStride > 0;
+		if (bCorrelate && (bSimulateOnGPU || domains.Active()))
+		{
+			cout << "MSD and VACF need a CPU run without domain decomposition, they are off" << endl;
+			bCorrelate = false;
+		}
+		correlator.Setup(bCorrelate ? N : 0, nThreads, bCorrelate ? correlatorPoints : 0, correlatorLevels, hugePages);
+		unwrapped = PageVector<Vector2<double>>(bCorrelate ? N : 0, PageAllocator<Vector2<double>>(hugePages));
+		lastSampled = PageVector<Vector2<real>>(bCorrelate ? N : 0, PageAllocator<Vector2<real>>(hugePages));
+		threadSampleV.Resize(nThreads);
+		lastCorrelateTime = 0;
+		bUnwrapWarned = false;
+		if (!bCorrelate)
+			return;
+#pragma omp parallel for num_threads(nThreads) schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			const int id = globalIds[i];
+			lastSampled[id] = comps[i].p;
+			unwrapped[id] = { double(comps[i].p.x), double(comps[i].p.y) };
+		}
+	}
+	// Every rank generated all N particles, each keeps the ones inside its domain
+	void KeepOwnedParticles()
+	{
+		nActive = 0;
+		for (int i = 0; i < N; ++i)
+			if (domains.Owner(comps[i].p) == domains.Rank())
+			{
+				comps[nActive] = comps[i];
+				globalIds[nActive] = i;
+				++nActive;
+			}
+		numInBox = nActive;
+		nGhost = 0;
+	}
+	// Called by one thread: ownership follows the positions just drifted, then ghosts are refreshed.
+	// Whatever sits behind nActive (escaped particles, old ghosts) is overwritten.
+	void ExchangeParticles()
+	{
+		nGhost = 0;
+		if (!domains.Migrate(comps, globalIds, nActive) ||
+			!domains.ExchangeHalo(comps, globalIds, nActive, nGhost))
+			nGhost = 0;
+		if (CompactsEscaped())
+			numInBox = nActive;
+		// Ghosts come back in a new order every time
+		if (domains.Active())
+			bListStale = true;
+	}
+	// Candidate pairs are known exactly from the bins, pairs that got a force evaluation
+	// are taken from the previous step and weigh more since that's where the time goes
+	void PlanCellTasks(CellPass& pass)
+	{
+		const double forceWeight = 4.0;
+		const CellGrid<real>& grid = pass.grid;
+		for (int cell = 0; cell < grid.NumCells(); ++cell)
+		{
+			double candidates = 0;
+			for (int k = grid.partnerStart[cell]; k < grid.partnerStart[cell + 1]; ++k)
+				candidates += grid.Count(grid.partners[k]);
+			candidates *= grid.Count(cell);
+			pass.costs[cell] = candidates + forceWeight * pass.pairs[cell];
+		}
+		pass.tasks.Plan(pass.costs, grid.NumCells(), omp_get_num_threads());
+	}
+
 	void Separation(Vector2<real>& d, Vector2<real>& L)
 	{
 		switch (edgeCondition) 
@@ -375,6 +1221,42 @@ private:
 		if (edgeCondition != 1 && std::abs(d.y) > real(0.5) * L.y)
 			d.y *= real(1.0) - L.y / std::abs(d.y);
 	}
+	bool RespaActive() const { return respaSteps > 1; }
+	// Tube mode pushes particles along, hole modes lose them
+	bool ConservesEnergy() const { return edgeCondition <= 2; }
+	// Steps of dt between two samples of the observables
+	int StepsPerSample() const
+	{
+		if (bSimulateOnGPU)
+			return 1;
+		if (BlockStepsActive())
+			return BlockSubsteps();
+		return RespaActive() ? respaSteps : 1;
+	}
+	bool BlockStepsActive() const { return timeStepLevels > 1; }
+	int BlockSubsteps() const { return 1 << (timeStepLevels - 1); }
+	// Whether the particle's block step ends at blockBoundary and it needs forces there
+	bool StepEnds(int i) const
+	{
+		return stepLevel.empty() || (blockBoundary & ((BlockSubsteps() >> stepLevel[i]) - 1)) == 0;
+	}
+	// Width of the switch from near to far forces, in units of sigma
+	static real RespaHealingWidth() { return real(0.5); }
+	// The near force is -d(S U)/dr, the far one whatever is left of the full force. U is the potential
+	// F()'s force derives from, 4 sigma^2 r6 (r6 - 1). The reported potential scales with epsilon
+	// instead and only matches it for epsilon = 4 sigma^2, the split would stop being conservative
+	void SplitForce(real r, real& force, int range)
+	{
+		const real rinv = sigma / r;
+		const real r3 = rinv * rinv * rinv;
+		const real r6 = r3 * r3;
+		const real potential = real(4.0) * sigma * sigma * r6 * (r6 - real(1.0));
+		const real rs = respaRadius * sigma;
+		real dS;
+		const real S = RespaSwitch(r, rs - RespaHealingWidth() * sigma, rs, dS);
+		const real nearForce = S * force - dS * potential / r;
+		force = range == ForcesNear ? nearForce : force - nearForce;
+	}
 	void F(real& r, real& force, real& potential)
 	{
 		real rinv = sigma / r;
@@ -384,145 +1266,1076 @@ private:
 		force = g * rinv;
 		potential = epsilon * r6 * (r6 - real(1.0));
 	}
-	void Accel(Vector2<real>& L, real& pe)
+	void EndStep()
 	{
-#pragma omp parallel for
-		for (int i = 0; i < N; ++i)
-			comps[i].a = { 0.0, 0.0 };
-		for (int i = 0; i < N - 1; ++i)
-			for (int j = i + 1; j < N; ++j)
+		_time.Add(accum(StepsPerSample() * dt));
+		++stepsTaken;
+	}
+	// Ends the step like EndStep() and samples the correlator every correlatorStride of them.
+	// Samples must be close enough in time that nobody moves half the box in between, the fastest
+	// particle times the gap checks that
+	void Correlate()
+	{
+#pragma omp single
+		{
+			EndStep();
+			bCorrelateNow = observables.Due(obsCorrelator, stepsTaken);
+			if (bCorrelateNow)
+			{
+				const double time = double(accum(_time));
+				correlator.Begin(time, nActive);
+				correlateGap = time - lastCorrelateTime;
+				lastCorrelateTime = time;
+			}
+		}
+		if (!bCorrelateNow)
+			return;
+		const int thread = omp_get_thread_num();
+		real maxV2 = 0;
+#pragma omp for schedule(static) nowait
+		for (int i = 0; i < nActive; ++i)
+		{
+			const Component<real>& c = comps[i];
+			const int id = globalIds[i];
+			Vector2<real> d = c.p - lastSampled[id];
+			Separation(d, Vector2r{ Lx, Ly });
+			lastSampled[id] = c.p;
+			unwrapped[id] += Vector2<double>{ double(d.x), double(d.y) };
+			correlator.Push(thread, id, unwrapped[id], Vector2<double>{ double(c.v.x), double(c.v.y) });
+			maxV2 = max(maxV2, c.v.SizeSqr());
+		}
+		threadSampleV[thread] = maxV2;
+#pragma omp barrier
+#pragma omp single
+		if (!bUnwrapWarned)
+		{
+			const double reach = sqrt(double(threadSampleV.Max(omp_get_num_threads()))) * correlateGap;
+			if (reach >= 0.5 * min(Lx, Ly))
 			{
-				Component<real>& ci = comps[i];
-				Component<real>& cj = comps[j];
-				if (ci.p.x > L.x || cj.p.x > L.x)
+				cout << "Particles cover up to " << reach << " between MSD samples, half the box or more, "
+					<< "lower correlatorStride or the MSD misses wraps" << endl;
+				bUnwrapWarned = true;
+			}
+		}
+	}
+	// Everything from here to UpdateStats is called by every thread of the region opened in Update(),
+	// or by a single thread outside of it. Work is split with orphaned omp for/single.
+	// Squared cutoff of a pass, and of its near part, which is the same outside of RESPA near passes
+	void PassRanges(int range, real& rc2, real& rs2) const
+	{
+		const real rc = cutoffRadius * sigma;
+		rc2 = rc > 0 ? rc * rc : (std::numeric_limits<real>::max)();
+		// Near passes skip the far pairs before any force math, that's where RESPA saves
+		const real rs = respaRadius * sigma;
+		rs2 = range == ForcesNear ? rs * rs : rc2;
+	}
+	// Which kernel a pass uses, the timing at Initialize() hasn't happened yet while it's Auto
+	int PassKernel(int range) const
+	{
+		if (range == ForcesNear || forceKernel == ForceKernelAuto)
+			return ForceKernelCells;
+		return forceKernel;
+	}
+	// One pair of any kernel once the index checks passed. f is the force on ci,
+	// false means the pair is out of range and nothing was added. rdf is the thread's g(r)
+	// histogram on a sampled pass, null otherwise
+	bool PairForce(const Component<real>& ci, const Component<real>& cj, bool bGhostPair, real rc2, real rs2, int range, Vector2<real>& f, accum& peLocal, double* rdf)
+	{
+		Vector2<real> d = ci.p - cj.p;
+		Separation(d, Vector2r{ Lx, Ly });
+		const real r2 = d.SizeSqr();
+		if (r2 > rc2 || r2 >= rs2)
+			return false;
+		real r = d.Size();
+		if (rdf != nullptr)
+			structure.AddPair(rdf, r, bGhostPair ? real(0.5) : real(1.0));
+		real force, potential;
+		F(r, force, potential);
+		if (range != ForcesAll)
+			SplitForce(r, force, range);
+		f = force * d;
+
+		// A pair across a domain border is seen by both ranks, each takes half
+		if (ci.p.x < Lx && cj.p.x < Lx)
+			peLocal += bGhostPair ? real(0.5) * potential : potential;
+		return true;
+	}
+	accum AccelCell(int cell, CellPass& pass, PageVector<Vector2<accum>>& acc, double* rdf, Vector2<real>& L, int range)
+	{
+		const CellGrid<real>& grid = pass.grid;
+		real rc2, rs2;
+		PassRanges(range, rc2, rs2);
+		accum peLocal = 0;
+		int pairs = 0;
+		for (int k = grid.partnerStart[cell]; k < grid.partnerStart[cell + 1]; ++k)
+		{
+			const int other = grid.partners[k];
+			for (int a = grid.cellStart[cell]; a < grid.cellStart[cell + 1]; ++a)
+			{
+				const int i = grid.items[a];
+				const Component<real>& ci = comps[i];
+				if (ci.p.x > L.x)
 					continue;
-				Vector2<real> d = ci.p - cj.p;
-				Separation(d, Vector2r{ Lx, Ly });
-				real r = d.Size();
-				real force, potential;
-				F(r, force, potential);
-				ci.a += force * d;
-				cj.a -= force * d;
+				const bool bGhostI = i >= nActive;
+				const bool bEndsI = StepEnds(i);
+				for (int b = (other == cell) ? a + 1 : grid.cellStart[other]; b < grid.cellStart[other + 1]; ++b)
+				{
+					const int j = grid.items[b];
+					const bool bGhostJ = j >= nActive;
+					// Owned by someone else on both ends, that rank does it
+					if (bGhostI && bGhostJ)
+						continue;
+					// Mid-step on both ends, nobody needs this pair now
+					const bool bEndsJ = StepEnds(j);
+					if (!bEndsI && !bEndsJ)
+						continue;
+					const Component<real>& cj = comps[j];
+					if (cj.p.x > L.x)
+						continue;
+					Vector2<real> f;
+					if (!PairForce(ci, cj, bGhostI || bGhostJ, rc2, rs2, range, f, peLocal, rdf))
+						continue;
+					if (bEndsI)
+					{
+						acc[i].x += f.x;
+						acc[i].y += f.y;
+					}
+					if (bEndsJ)
+					{
+						acc[j].x -= f.x;
+						acc[j].y -= f.y;
+					}
+					++pairs;
+				}
+			}
+		}
+		pass.pairs[cell] = pairs;
+		return peLocal;
+	}
+	// Row tile against itself and every tile after it, by index and not by position.
+	// Forces on the row particle stay in registers over a whole column tile, the column's
+	// gather in a tile-sized buffer and go out once per tile
+	accum AccelTileRow(int row, PageVector<Vector2<accum>>& acc, double* rdf, Vector2<real>& L, int range)
+	{
+		real rc2, rs2;
+		PassRanges(range, rc2, rs2);
+		const int n = nActive + nGhost;
+		const int nTiles = (n + ForceTileSize - 1) / ForceTileSize;
+		const int iBegin = row * ForceTileSize;
+		const int iEnd = (std::min)(n, iBegin + ForceTileSize);
+		Vector2<accum> columnForce[ForceTileSize];
+		accum peLocal = 0;
+		for (int column = row; column < nTiles; ++column)
+		{
+			const int jBegin = column * ForceTileSize;
+			const int jEnd = (std::min)(n, jBegin + ForceTileSize);
+			for (int b = 0; b < jEnd - jBegin; ++b)
+				columnForce[b] = { 0.0, 0.0 };
+			for (int i = iBegin; i < iEnd; ++i)
+			{
+				const Component<real>& ci = comps[i];
+				if (ci.p.x > L.x)
+					continue;
+				const bool bGhostI = i >= nActive;
+				const bool bEndsI = StepEnds(i);
+				Vector2<accum> rowForce = { 0.0, 0.0 };
+				for (int j = (column == row) ? i + 1 : jBegin; j < jEnd; ++j)
+				{
+					const bool bGhostJ = j >= nActive;
+					if (bGhostI && bGhostJ)
+						continue;
+					const bool bEndsJ = StepEnds(j);
+					if (!bEndsI && !bEndsJ)
+						continue;
+					const Component<real>& cj = comps[j];
+					if (cj.p.x > L.x)
+						continue;
+					Vector2<real> f;
+					if (!PairForce(ci, cj, bGhostI || bGhostJ, rc2, rs2, range, f, peLocal, rdf))
+						continue;
+					if (bEndsI)
+					{
+						rowForce.x += f.x;
+						rowForce.y += f.y;
+					}
+					if (bEndsJ)
+					{
+						columnForce[j - jBegin].x -= f.x;
+						columnForce[j - jBegin].y -= f.y;
+					}
+				}
+				acc[i] += rowForce;
+			}
+			for (int b = 0; b < jEnd - jBegin; ++b)
+				acc[jBegin + b] += columnForce[b];
+		}
+		return peLocal;
+	}
+	// A rebuilding pass walks the cells like AccelCell() and keeps every pair within the skin,
+	// the passes after it only go through what was kept
+	accum AccelListCell(int cell, PageVector<Vector2<accum>>& acc, double* rdf, Vector2<real>& L, int range)
+	{
+		std::vector<std::pair<int, int>>& list = listPairs[cell];
+		if (bRebuildList)
+		{
+			const CellGrid<real>& grid = listCells.grid;
+			const real rl = (cutoffRadius + neighbourSkin) * sigma;
+			const real rl2 = rl * rl;
+			list.clear();
+			for (int a = grid.cellStart[cell]; a < grid.cellStart[cell + 1]; ++a)
+				listOrigins[grid.items[a]] = comps[grid.items[a]].p;
+			for (int k = grid.partnerStart[cell]; k < grid.partnerStart[cell + 1]; ++k)
+			{
+				const int other = grid.partners[k];
+				for (int a = grid.cellStart[cell]; a < grid.cellStart[cell + 1]; ++a)
+				{
+					const int i = grid.items[a];
+					for (int b = (other == cell) ? a + 1 : grid.cellStart[other]; b < grid.cellStart[other + 1]; ++b)
+					{
+						const int j = grid.items[b];
+						if (i >= nActive && j >= nActive)
+							continue;
+						Vector2<real> d = comps[i].p - comps[j].p;
+						Separation(d, Vector2r{ Lx, Ly });
+						if (d.SizeSqr() < rl2)
+							list.push_back(std::make_pair(i, j));
+					}
+				}
+			}
+		}
 
-				if (ci.p.x < Lx && cj.p.x < Lx)
-					pe += potential;
+		real rc2, rs2;
+		PassRanges(range, rc2, rs2);
+		accum peLocal = 0;
+		for (const std::pair<int, int>& pair : list)
+		{
+			const int i = pair.first;
+			const int j = pair.second;
+			const bool bEndsI = StepEnds(i);
+			const bool bEndsJ = StepEnds(j);
+			if (!bEndsI && !bEndsJ)
+				continue;
+			const Component<real>& ci = comps[i];
+			const Component<real>& cj = comps[j];
+			if (ci.p.x > L.x || cj.p.x > L.x)
+				continue;
+			Vector2<real> f;
+			if (!PairForce(ci, cj, i >= nActive || j >= nActive, rc2, rs2, range, f, peLocal, rdf))
+				continue;
+			if (bEndsI)
+			{
+				acc[i].x += f.x;
+				acc[i].y += f.y;
 			}
+			if (bEndsJ)
+			{
+				acc[j].x -= f.x;
+				acc[j].y -= f.y;
+			}
+		}
+		listCells.pairs[cell] = int(list.size());
+		return peLocal;
 	}
-	void Verlet()
+	// Largest move since the neighbour list was built, every thread takes its share
+	void MeasureListMoves()
 	{
-		for (int i = 0; i < N; ++i)
+		const int n = nActive + nGhost;
+		real maxMove2 = 0;
+		if (!bListStale)
 		{
-			Component<real>& c = comps[i];
-			Vector2<real> newP = c.p + c.v * dt + real(0.5) * c.a * dt2;
-			c.v += real(0.5) * c.a * dt;
-			switch (edgeCondition)
+#pragma omp for schedule(static) nowait
+			for (int i = 0; i < n; ++i)
 			{
-			case 0:
-				Transport_PhaseXY(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 1:
-				Transport_PhaseX(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 2:
-				Transport_Closed(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 3:
-				Transport_HoleInABox(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 4:
-				Transport_HoleInABox_PhaseY(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 5:
-				Transport_HoleInABox_NonEuclidean(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
-			case 6:
-				Transport_Tube(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+				Vector2<real> d = comps[i].p - listOrigins[i];
+				Separation(d, Vector2r{ Lx, Ly });
+				maxMove2 = max(maxMove2, d.SizeSqr());
 			}
-			c.p = newP;
 		}
-		Accel(Vector2<real>{ Lx, Ly }, pe);
+		threadMaxMove[omp_get_thread_num()] = maxMove2;
+#pragma omp barrier
+	}
+	// Once a particle has moved half the skin, some pair may have closed in from outside it
+	void PlanListTasks()
+	{
+		const int n = nActive + nGhost;
+		const real halfSkin = real(0.5) * neighbourSkin * sigma;
+		bRebuildList = bListStale || threadMaxMove.Max(omp_get_num_threads()) >= halfSkin * halfSkin;
+		if (bRebuildList)
+		{
+			listCells.grid.Build(comps, n);
+			if (int(listOrigins.size()) < n)
+				listOrigins.resize(n);
+			PlanCellTasks(listCells);
+			bListStale = false;
+			return;
+		}
+		for (int cell = 0; cell < listCells.grid.NumCells(); ++cell)
+			listCells.costs[cell] = double(listCells.pairs[cell]);
+		listCells.tasks.Plan(listCells.costs, listCells.grid.NumCells(), omp_get_num_threads());
+	}
+	void PlanTileTasks()
+	{
+		const int nTiles = (nActive + nGhost + ForceTileSize - 1) / ForceTileSize;
+		tileCosts.resize(nTiles);
+		for (int row = 0; row < nTiles; ++row)
+			tileCosts[row] = double(nTiles - row);
+		tileTasks.Plan(tileCosts, nTiles, omp_get_num_threads());
+	}
+	// The sampled pass's positions are copied and rho(k) is worked out next to the steps that follow.
+	// Ranks only hold their own particles, their modes are added up once the work is collected
+	void SnapshotModes()
+	{
+#pragma omp single
+		{
+			modeSnapshots.push_back(std::make_shared<ModeSnapshot>());
+			modeSnapshots.back()->positions.resize(nActive);
+		}
+		std::vector<Vector2<real>>& positions = modeSnapshots.back()->positions;
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+			positions[i] = comps[i].p;
+#pragma omp single nowait
+		{
+			std::shared_ptr<ModeSnapshot> snapshot = modeSnapshots.back();
+			const real xMax = Lx;
+			observables.Defer([this, snapshot, xMax]()
+			{
+				std::vector<Vector2<real>>& p = snapshot->positions;
+				p.erase(std::remove_if(p.begin(), p.end(), [xMax](const Vector2<real>& q) { return q.x >= xMax; }), p.end());
+				structure.Modes(p.data(), int(p.size()), snapshot->rho);
+				snapshot->count = int(p.size());
+				p = std::vector<Vector2<real>>();
+			});
+		}
+	}
+	// The far pass still adds the whole potential, so pe is complete after it.
+	// bMeasured passes are the ones the observables are taken from, g(r) samples some of them
+	void Accel(Vector2<real>& L, accum& pe, int range = ForcesAll, bool bMeasured = false)
+	{
+		const int thread = omp_get_thread_num();
+		const int nTeam = omp_get_num_threads();
+		PageVector<Vector2<accum>>& acc = threadAccel[thread];
+		for (int i = 0; i < nActive + nGhost; ++i)
+			acc[i] = { 0.0, 0.0 };
 
-		// Explosion protection
+		const int kernel = PassKernel(range);
+		if (kernel == ForceKernelNeighbourList)
+			MeasureListMoves();
+		CellPass& pass = range == ForcesNear ? nearCells : cells;
+#pragma omp single
+		{
+			switch (kernel)
+			{
+			case ForceKernelAllPairs:
+				PlanTileTasks(); break;
+			case ForceKernelNeighbourList:
+				PlanListTasks(); break;
+			default:
+				pass.grid.Build(comps, nActive + nGhost);
+				PlanCellTasks(pass);
+				break;
+			}
+			++forceEvaluations;
+			bStructurePass = bMeasured && observables.Due(obsStructure, stepsTaken);
+			if (bStructurePass)
+				structure.AddSample(domains.Active() ? N : nActive);
+			bFieldPass = bMeasured && observables.Due(obsFields, stepsTaken);
+			if (bFieldPass)
+				fields.AddSample();
+		}
+		double* rdf = bStructurePass ? structure.ThreadBins(thread) : nullptr;
+		accum peLocal = 0;
+		switch (kernel)
+		{
+		case ForceKernelAllPairs:
+			tileTasks.Run(thread, [&](int row) { peLocal += AccelTileRow(row, acc, rdf, L, range); }); break;
+		case ForceKernelNeighbourList:
+			listCells.tasks.Run(thread, [&](int cell) { peLocal += AccelListCell(cell, acc, rdf, L, range); }); break;
+		default:
+			pass.tasks.Run(thread, [&](int cell) { peLocal += AccelCell(cell, pass, acc, rdf, L, range); }); break;
+		}
+#pragma omp barrier
+		if (bMeasured && observables.Due(obsModes, stepsTaken))
+			SnapshotModes();
+
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			Vector2<accum> sum = { 0.0, 0.0 };
+			for (int t = 0; t < nTeam; ++t)
+				sum += threadAccel[t][i];
+			// Mid-step particles keep the forces their step started with
+			if (!StepEnds(i))
+				continue;
+			const Vector2<real> a = { real(sum.x), real(sum.y) };
+			if (range == ForcesFar)
+				farAccel[i] = a;
+			else
+				comps[i].a = a;
+		}
+#pragma omp atomic
+		pe += peLocal;
+	}
+	// What one thread saw of the observables during the measured kick. The maxima are left
+	// to the next AdjustTimeStep(), which then needs no pass of its own
+	struct Observed
+	{
+		accum ke = 0;
+		accum virial = 0;
+		int numInBox = 0;
+		real maxV2 = 0;
+		real maxA2 = 0;
+		// This thread's field bins if the pass samples them
+		double* fieldBins = nullptr;
+	};
+	Observed StartObserving()
+	{
+		Observed local;
+		if (bFieldPass)
+			local.fieldBins = fields.ThreadBins(omp_get_thread_num());
+		return local;
+	}
+	void Observe(const Vector2<real>& p, const Vector2<real>& v, const Vector2<real>& a, bool bCountInBox, Observed& local)
+	{
+		if (p.x < Lx)
+			local.ke += real(0.5) * v.SizeSqr();
+		local.virial += p * a;
+		if (bCountInBox && p.x < Lx * 1.05)
+			++local.numInBox;
+		local.maxV2 = max(local.maxV2, v.SizeSqr());
+		local.maxA2 = max(local.maxA2, a.SizeSqr());
+		if (local.fieldBins)
+			fields.Add(local.fieldBins, p, v);
+	}
+	void AddObserved(const Observed& local, bool bCountInBox)
+	{
+		const int thread = omp_get_thread_num();
+		threadMaxV[thread] = local.maxV2;
+		threadMaxA[thread] = local.maxA2;
+#pragma omp atomic
+		ke += local.ke;
+#pragma omp atomic
+		virial += local.virial;
+		if (bCountInBox)
+		{
+#pragma omp atomic
+			numInBox += local.numInBox;
+		}
+	}
+	// Explosion protection
+	real MaxForce()
+	{
 		real maxForce;
 		real garbage;
 		real r = sigma * explosionProtectionThreshold;
 		F(r, maxForce, garbage);
-		for (int i = 0; i < N; ++i)
+		return maxForce;
+	}
+	void Drift(Component<real>& c, real drift)
+	{
+		Vector2<real> newP = c.p + drift * c.v;
+		switch (edgeCondition)
 		{
-			auto thisForce = comps[i].a;
-			if (thisForce.SizeSqr() >= maxForce * maxForce)
-				comps[i].a = thisForce.Normalized() * maxForce;
+		case 0:
+			Transport_PhaseXY(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 1:
+			Transport_PhaseX(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 2:
+			Transport_Closed(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 3:
+			Transport_HoleInABox(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 4:
+			Transport_HoleInABox_PhaseY(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 5:
+			Transport_HoleInABox_NonEuclidean(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
+		case 6:
+			Transport_Tube(newP, Vector2<real>{ xFlux, yFlux }, c.v, Vector2<real>{ Lx, Ly }); break;
 		}
+		c.p = newP;
+	}
+	// Clamps the forces, kicks, takes the observables if asked and drifts, in one pass over the particles
+	void Stage(real kick, real drift, bool bDrift, bool bMeasure)
+	{
+		const real maxForce = MaxForce();
 
-		numInBox = 0;
-		for (int i = 0; i < N; ++i)
+		// Compacting modes keep numInBox in sync with nActive, the rest count it here
+		const bool bCountInBox = bMeasure && !CompactsEscaped();
+		const real measureShift = scheme.measureShift * dt;
+		Observed local = StartObserving();
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
 		{
 			Component<real>& c = comps[i];
-			c.v += real(0.5) * c.a * dt;
-			if (c.p.x < Lx) 
-				ke += real(0.5) * c.v.SizeSqr();
-			virial += c.p * c.a;
-			if (c.p.x < Lx * 1.05)
-				++numInBox;
+			if (c.a.SizeSqr() >= maxForce * maxForce)
+				c.a = c.a.Normalized() * maxForce;
+
+			c.v += kick * c.a;
+			if (bMeasure)
+				Observe(c.p, c.v + measureShift * c.a, c.a, bCountInBox, local);
+			if (!bDrift)
+				continue;
+
+			Drift(c, drift);
+		}
+		if (bMeasure)
+			AddObserved(local, bCountInBox);
+	}
+	// One step of the splitting scheme. Velocity Verlet is a half kick fused with the drift,
+	// the forces, and the other half kick
+	void Verlet(int range, bool bMeasure)
+	{
+		const int nDrifts = scheme.NumDrifts();
+		for (int s = 0; s <= nDrifts; ++s)
+		{
+			const bool bDrift = s < nDrifts;
+			Stage(scheme.kicks[s] * dt, bDrift ? scheme.drifts[s] * dt : real(0), bDrift, bMeasure && s == scheme.measureKick);
+			if (!bDrift)
+				break;
+
+			const bool bMeasuredNext = bMeasure && s + 1 == scheme.measureKick;
+#pragma omp single
+			{
+				CompactActive();
+				if (domains.Active())
+					ExchangeParticles();
+				if (bMeasuredNext && !CompactsEscaped())
+					numInBox = 0;
+			}
+			if (!scheme.NeedsForces(s))
+				continue;
+			Accel(Vector2<real>{ Lx, Ly }, bMeasuredNext ? pe : peUnmeasured, range, bMeasuredNext);
+			// Counted on the positions the observables are taken at, the cells are still fresh
+			if (bMeasuredNext)
+				CountCollisions();
+		}
+	}
+	void FarKick(real kick, bool bMeasure)
+	{
+		const bool bCountInBox = bMeasure && !CompactsEscaped();
+		Observed local = StartObserving();
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			Component<real>& c = comps[i];
+			c.v += kick * farAccel[i];
+			if (bMeasure)
+				Observe(c.p, c.v, c.a + farAccel[i], bCountInBox, local);
+		}
+		if (bMeasure)
+			AddObserved(local, bCountInBox);
+	}
+	// r-RESPA around the splitting scheme: a far half kick, respaSteps steps of the scheme on the
+	// near forces, then the far forces and the other half kick. The far forces are reused by
+	// the next step's first half kick since nothing drifts in between
+	void RespaStep()
+	{
+		const real farKick = real(0.5) * respaSteps * dt;
+		FarKick(farKick, false);
+		for (int step = 0; step < respaSteps; ++step)
+			Verlet(ForcesNear, false);
+		// Observables need the near forces at the end, a scheme that skips them gets them here
+		if (!scheme.NeedsForces(scheme.NumDrifts() - 1))
+			Accel(Vector2<real>{ Lx, Ly }, peUnmeasured, ForcesNear);
+
+#pragma omp single
+		if (!CompactsEscaped())
+			numInBox = 0;
+		Accel(Vector2<real>{ Lx, Ly }, pe, ForcesFar, true);
+		CountCollisions();
+		FarKick(farKick, true);
+	}
+	// Finest level that keeps the particle inside the path criterion of AdjustTimeStep() on its own
+	int DesiredLevel(const Component<real>& c)
+	{
+		const real ownDt = min(Lx, Ly) / (real(2.0) * sqrt(c.a.Size()) + c.v.Size()) * ATSPathThreshold * dtScale;
+		const int nSub = BlockSubsteps();
+		int level = 0;
+		while (level < timeStepLevels - 1 && (nSub >> level) * dt > ownDt)
+			++level;
+		return level;
+	}
+	// Hierarchical block steps over BlockSubsteps() substeps of dt. Everyone drifts every substep
+	// so forces see current positions, but only particles whose step ends get forces and a kick.
+	// A particle can go a level finer after any of its steps, coarser only where both levels line up
+	void BlockStep()
+	{
+		const int nSub = BlockSubsteps();
+		const real maxForce = MaxForce();
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+			stepLevel[i] = DesiredLevel(comps[i]);
+
+		for (int sub = 0; sub < nSub; ++sub)
+		{
+#pragma omp for schedule(static)
+			for (int i = 0; i < nActive; ++i)
+			{
+				Component<real>& c = comps[i];
+				const int span = nSub >> stepLevel[i];
+				if ((sub & (span - 1)) == 0)
+					c.v += real(0.5) * span * dt * c.a;
+				Drift(c, dt);
+			}
+
+			const bool bLast = sub + 1 == nSub;
+#pragma omp single
+			{
+				CompactActive();
+				if (bLast && !CompactsEscaped())
+					numInBox = 0;
+				blockBoundary = sub + 1;
+			}
+			// Every level ends with the block, that pass is a full one
+			Accel(Vector2<real>{ Lx, Ly }, bLast ? pe : peUnmeasured, ForcesAll, bLast);
+			if (bLast)
+				CountCollisions();
+
+			const bool bCountInBox = bLast && !CompactsEscaped();
+			Observed local = StartObserving();
+#pragma omp for schedule(static)
+			for (int i = 0; i < nActive; ++i)
+			{
+				if (!StepEnds(i))
+					continue;
+				Component<real>& c = comps[i];
+				if (c.a.SizeSqr() >= maxForce * maxForce)
+					c.a = c.a.Normalized() * maxForce;
+				const int level = stepLevel[i];
+				c.v += real(0.5) * (nSub >> level) * dt * c.a;
+				if (bLast)
+				{
+					Observe(c.p, c.v, c.a, bCountInBox, local);
+					continue;
+				}
+				const int desired = DesiredLevel(c);
+				if (desired > level)
+					stepLevel[i] = desired;
+				else if (desired < level && ((sub + 1) & ((nSub >> (level - 1)) - 1)) == 0)
+					stepLevel[i] = level - 1;
+			}
+			if (bLast)
+				AddObserved(local, bCountInBox);
 		}
 	}
 	void AdjustTimeStep()
 	{
-		real Lmin = min(Lx, Ly);
 		real Amax = 0;
 		real Vmax = 0;
-		for (int i = 0; i < N; ++i)
+		if (!bHaveStepMaxima)
 		{
-			Vmax = max(comps[i].v.SizeSqr(), Vmax);
-			Amax = max(comps[i].a.SizeSqr(), Amax);
+			const int thread = omp_get_thread_num();
+#pragma omp for schedule(static) nowait
+			for (int i = 0; i < nActive; ++i)
+			{
+				Vmax = max(comps[i].v.SizeSqr(), Vmax);
+				Amax = max(comps[i].a.SizeSqr(), Amax);
+			}
+			threadMaxV[thread] = Vmax;
+			threadMaxA[thread] = Amax;
 		}
-		Amax = sqrt(sqrt(Amax));
-		Vmax = sqrt(Vmax);
+#pragma omp barrier
+#pragma omp single
+		{
+			const int nTeam = omp_get_num_threads();
+			real Lmin = min(Lx, Ly);
+			double globalMax[] = { threadMaxA.Max(nTeam), threadMaxV.Max(nTeam) };
+			domains.Max(globalMax, 2);
+			Amax = sqrt(sqrt(real(globalMax[0])));
+			Vmax = sqrt(real(globalMax[1]));
 
-		dt = (Lmin / (Amax * 2 + Vmax)) * ATSPathThreshold;
-		dt2 = dt * dt;
+			dt = (Lmin / (Amax * 2 + Vmax)) * ATSPathThreshold * dtScale;
+			dt2 = dt * dt;
+			// The GPU steps leave nothing behind
+			bHaveStepMaxima = !bSimulateOnGPU;
+		}
 	}
-	void CountCollisions() 
+	// Called with the stats of every update. Only the ends of the window are compared,
+	// oscillations inside it don't count against the budget
+	void ControlTimeStep(real E, real T)
+	{
+		if (energyDriftBudget <= 0)
+			return;
+		if (++windowUpdates < energyDriftWindow)
+			return;
+		const real span = real(_time) - windowStartTime;
+		const real scale = T > 0 ? T : real(1.0);
+		const real rate = span > 0 ? std::abs(E - windowStartE) / (scale * span) : 0;
+		const real growth = 1.25;
+		const real minScale = real(1.0) / 64;
+		const real maxScale = 64;
+		if (rate > energyDriftBudget)
+			dtScale = (std::max)(minScale, dtScale * real(0.5));
+		else if (rate < real(0.5) * energyDriftBudget)
+			dtScale = (std::min)(maxScale, dtScale * growth);
+		if (!bUseAdaptiveTimeStep)
+		{
+			dt = configDt * dtScale;
+			dt2 = dt * dt;
+		}
+		windowUpdates = 0;
+		windowStartE = E;
+		windowStartTime = real(_time);
+	}
+	// A close pair is credited to the particle generated first, same as the old i < j scan.
+	// Across a domain border only the rank owning that particle counts it
+	void CountCollisionsCell(int cell)
 	{
+		const CellGrid<real>& grid = cells.grid;
 		real sigma2 = sigma * sigma;
 		real thresh2 = collisionRadiusThreshold * collisionRadiusThreshold;
-		for (int i = 0; i < N - 1; ++i)
+		for (int k = grid.partnerStart[cell]; k < grid.partnerStart[cell + 1]; ++k)
 		{
-			int numColls = 0;
-			for (int j = i + 1; j < N; j++)
+			const int other = grid.partners[k];
+			for (int a = grid.cellStart[cell]; a < grid.cellStart[cell + 1]; ++a)
 			{
-				// sigma^2 >= r^2/thresh^2 = collision
-				Vector2r r = comps[i].p - comps[j].p;
-				if (sigma2 >= r.SizeSqr() / thresh2)
-					numColls++;
+				const int i = grid.items[a];
+				for (int b = (other == cell) ? a + 1 : grid.cellStart[other]; b < grid.cellStart[other + 1]; ++b)
+				{
+					const int j = grid.items[b];
+					// sigma^2 >= r^2/thresh^2 = collision
+					Vector2r r = comps[i].p - comps[j].p;
+					if (bClusterPass && i < nActive && j < nActive)
+					{
+						// Unlike the count, clusters reach across the periodic edges
+						Vector2r d = r;
+						Separation(d, Vector2r{ Lx, Ly });
+						if (sigma2 >= d.SizeSqr() / thresh2)
+							clusters.Unite(i, j);
+					}
+					if (bCountPass && sigma2 >= r.SizeSqr() / thresh2)
+					{
+						const int first = globalIds[i] < globalIds[j] ? i : j;
+						if (first < nActive)
+						{
+#pragma omp atomic
+							++collisionCounts[first];
+						}
+					}
+				}
 			}
+		}
+	}
+	// Reuses the cells and the plan of the force pass, positions haven't moved since.
+	// The other kernels don't bin into cells, so they're binned here
+	void CountCollisions() 
+	{
+		const bool bSampleCollisions = observables.Due(obsCollisions, stepsTaken);
+		const bool bSampleClusters = observables.Due(obsClusters, stepsTaken);
+		if (!bSampleCollisions && !bSampleClusters)
+			return;
+		if (bSampleClusters)
+		{
+#pragma omp for schedule(static) nowait
+			for (int i = 0; i < nActive; ++i)
+				clusters.Reset(i);
+		}
+#pragma omp single
+		{
+			bCountPass = bSampleCollisions;
+			bClusterPass = bSampleClusters;
+			if (PassKernel(ForcesAll) == ForceKernelCells)
+				cells.tasks.Reset();
+			else
+			{
+				cells.grid.Build(comps, nActive + nGhost);
+				PlanCellTasks(cells);
+			}
+		}
+		cells.tasks.Run(omp_get_thread_num(), [&](int cell) { CountCollisionsCell(cell); });
+#pragma omp barrier
+		if (bSampleClusters)
+			CountClusters();
+		if (!bSampleCollisions)
+			return;
+
+		long long collisionsLocal = 0;
+		long long doubleLocal = 0;
+		long long tripleLocal = 0;
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			int numColls = collisionCounts[i];
+			collisionCounts[i] = 0;
 			if (numColls > 0)
-				collisionsNum++;
+				collisionsLocal++;
 			switch (numColls) 
 			{
 			case 1:
-				doubleCollisions++;
+				doubleLocal++;
 				break;
 			case 2:
-				tripleCollisions++;
+				tripleLocal++;
 				break;
 			}
 		}
+#pragma omp atomic
+		collisionsNum += collisionsLocal;
+#pragma omp atomic
+		doubleCollisions += doubleLocal;
+#pragma omp atomic
+		tripleCollisions += tripleLocal;
+	}
+	// Sizes are added up on the roots, then every root puts its cluster into a bin.
+	// Indices are positions in the arrays, which is fine since nothing moves in between
+	void CountClusters()
+	{
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			const int root = clusters.Find(i);
+#pragma omp atomic
+			++clusterSizes[root];
+		}
+		const int thread = omp_get_thread_num();
+		std::vector<double>& bins = threadClusterBins[thread];
+		int largest = 0;
+		double count = 0;
+#pragma omp for schedule(static)
+		for (int i = 0; i < nActive; ++i)
+		{
+			const int size = clusterSizes[i];
+			if (size == 0)
+				continue;
+			clusterSizes[i] = 0;
+			int bin = 0;
+			while ((2 << bin) <= size && bin + 1 < ClusterSizeBins)
+				++bin;
+			bins[bin] += 1;
+			largest = (std::max)(largest, size);
+			count += 1;
+		}
+		threadLargestCluster[thread] = largest;
+#pragma omp atomic
+		clusterCountSum += count;
+#pragma omp barrier
+#pragma omp single
+		{
+			largestClusterSum += double(threadLargestCluster.Max(omp_get_num_threads())) / (std::max)(1, nActive);
+			++clusterSamples;
+			bClusterPass = false;
+		}
 	}
 	void UpdateStats() 
 	{
+		// Collision counters are cumulative, so only the global copies are summed
+		long long collisionsAll = collisionsNum;
+		long long doubleAll = doubleCollisions;
+		long long tripleAll = tripleCollisions;
+		if (domains.Active())
+		{
+			double totals[] = { double(ke), double(pe), double(virial), double(numInBox),
+				double(collisionsAll), double(doubleAll), double(tripleAll) };
+			domains.Sum(totals, 7);
+			ke = accum(totals[0]);
+			pe = accum(totals[1]);
+			virial = accum(totals[2]);
+			numInBox = int(totals[3]);
+			collisionsAll = (long long)totals[4];
+			doubleAll = (long long)totals[5];
+			tripleAll = (long long)totals[6];
+		}
+
 		ke /= nAvg;
 		pe /= nAvg;
-		real E = (pe + ke) / N;
-		real T = ke / N;
-		real pFlux = ((xFlux / (real(2.0) * Lx)) + (yFlux / (real(2.0) * Ly))) / (dt * nAvg);
-		real pvirial = (N * T) / (Lx * Ly) + real(0.5) * virial / (nAvg * Lx * Ly);
-		real doubleCollsPerc = real(100) * real(doubleCollisions) / real(collisionsNum);
-		real tripleCollsPerc = real(100) * real(tripleCollisions) / real(collisionsNum);
-
-		stats["E"] = E;
-		stats["T"] = T;
-		stats["pFlux"] = pFlux;
-		stats["pvirial"] = pvirial;
-		stats["Time"] = real(_time);
-		stats["Hits double"] = doubleCollsPerc;
-		stats["Hits triple"] = tripleCollsPerc;
-		stats["In box"] = real(numInBox);
-		
+		real E = real((pe + ke) / N);
+		real T = real(ke / N);
+		const real elapsed = real(accum(_time) - updateStartTime);
+		real pFlux = ((xFlux / (real(2.0) * Lx)) + (yFlux / (real(2.0) * Ly))) / elapsed;
+		real pvirial = (N * T) / (Lx * Ly) + real(0.5 * virial / (nAvg * Lx * Ly));
+		real doubleCollsPerc = real(100) * real(doubleAll) / real(collisionsAll);
+		real tripleCollsPerc = real(100) * real(tripleAll) / real(collisionsAll);
+		if (!bHaveInitialEnergy)
+		{
+			initialEnergy = windowStartE = E;
+			windowStartTime = real(_time);
+			windowUpdates = 0;
+			bHaveInitialEnergy = true;
+		}
+		else
+			ControlTimeStep(E, T);
+		// Relative to where the run started, compare integrators at the same Time and Force evals
+		real EDrift = initialEnergy != 0 ? (E - initialEnergy) / std::abs(initialEnergy) : E;
+
+		stats.Set(handles.E, E);
+		stats.Set(handles.T, T);
+		stats.Set(handles.pFlux, pFlux);
+		stats.Set(handles.pvirial, pvirial);
+		stats.Set(handles.time, real(_time));
+		if (observables.Enabled(obsCollisions))
+		{
+			stats.Set(handles.hitsDouble, doubleCollsPerc);
+			stats.Set(handles.hitsTriple, tripleCollsPerc);
+		}
+		stats.Set(handles.inBox, real(numInBox));
+		stats.Set(handles.EDrift, EDrift);
+		stats.Set(handles.forceEvals, real(forceEvaluations));
+		if (energyDriftBudget > 0)
+			stats.Set(handles.dtScale, dtScale);
+		if (structure.Enabled())
+			UpdateStructure();
+		if (observables.Enabled(obsCorrelator))
+			UpdateCorrelations();
+		if (clusterSamples > 0)
+			UpdateClusters();
+		if (fields.Enabled())
+			UpdateFields();
+		UpdateAverages();
+		stats.Publish();
+		if (outputStride > 0 && updatesDone % outputStride == 0)
+			WriteOutputs();
+	}
+	// filename with outputSuffix before its extension, "" stays ""
+	std::string OutputName(const std::string& filename) const
+	{
+		if (filename.empty() || outputSuffix.empty())
+			return filename;
+		const size_t dot = filename.find_last_of('.');
+		const size_t slash = filename.find_last_of("/\\");
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+			return filename + outputSuffix;
+		return filename.substr(0, dot) + outputSuffix + filename.substr(dot);
+	}
+	// This update's stats go into the blocks, the averages so far into the stats. There's
+	// no mean and an infinite error until the blocks say more
+	void UpdateAverages()
+	{
+		const bool bAdd = ++updatesDone > averageWarmup;
+		for (AveragedStat& average : averages)
+		{
+			BlockAverager& blocks = average.blocks;
+			if (bAdd && average.source >= 0)
+				blocks.Add(stats.Get(average.source));
+			stats.Set(average.mean, blocks.Count() > 0 ? real(blocks.Mean()) : std::numeric_limits<real>::quiet_NaN());
+			stats.Set(average.error, real(blocks.Error()));
+
+			std::vector<real>& levels = profiles[average.name + " block errors"];
+			levels.resize(blocks.NumLevels());
+			for (int k = 0; k < int(levels.size()); ++k)
+				levels[k] = real(blocks.LevelError(k));
+		}
+	}
+	bool TargetReached() const
+	{
+		if (targetError <= 0)
+			return false;
+		for (const AveragedStat& average : averages)
+			if (average.name == targetObservable)
+				return average.blocks.Error() <= targetError;
+		return false;
+	}
+	// Averages over the samples of this update, bins start at sizes 1, 2, 4, 8 ..
+	void UpdateClusters()
+	{
+		std::vector<real>& sizes = profiles["cluster size"];
+		std::vector<real>& counts = profiles["clusters"];
+		sizes.assign(ClusterSizeBins, 0);
+		counts.assign(ClusterSizeBins, 0);
+		for (int b = 0; b < ClusterSizeBins; ++b)
+		{
+			double sum = 0;
+			for (std::vector<double>& bins : threadClusterBins)
+			{
+				sum += bins[b];
+				bins[b] = 0;
+			}
+			sizes[b] = real(1 << b);
+			counts[b] = real(sum / clusterSamples);
+		}
+		// Nothing past the last bin that has clusters
+		while (!counts.empty() && counts.back() == 0)
+		{
+			sizes.pop_back();
+			counts.pop_back();
+		}
+		stats.Set(handles.largestCluster, real(largestClusterSum / clusterSamples));
+		stats.Set(handles.clusters, real(clusterCountSum / clusterSamples));
+		largestClusterSum = clusterCountSum = 0;
+		clusterSamples = 0;
+	}
+	// Ranks without the file only drop their samples
+	void UpdateFields()
+	{
+		fields.Gather(fieldsMerged, nThreads);
+		domains.Sum(fieldsMerged.data(), int(fieldsMerged.size()));
+		fields.WriteFrame(fieldsMerged, double(accum(_time)));
+	}
+	void UpdateCorrelations()
+	{
+		correlator.Gather(nThreads);
+		std::vector<real>& lag = profiles["lag"];
+		std::vector<real>& msd = profiles["MSD"];
+		std::vector<real>& vacf = profiles["VACF"];
+		correlator.Results(lag, msd, vacf);
+		if (lag.empty())
+			return;
+		// Einstein relation in 2D at the longest lag so far, only means something once that's diffusive
+		if (lag.back() > 0)
+			stats.Set(handles.D, msd.back() / (real(4.0) * lag.back()));
+	}
+	void WriteCorrelations()
+	{
+		const std::vector<real>& lag = profiles["lag"];
+		const std::vector<real>& msd = profiles["MSD"];
+		const std::vector<real>& vacf = profiles["VACF"];
+		if (correlatorFilename.empty() || lag.empty())
+			return;
+		std::ofstream out(OutputName(correlatorFilename));
+		out.precision(8);
+		out << "t\tMSD\tVACF" << std::endl;
+		for (size_t l = 0; l < lag.size(); ++l)
+			out << lag[l] << "\t" << msd[l] << "\t" << vacf[l] << std::endl;
+	}
+	// Adds what the threads binned since the last update, then refreshes the profiles
+	void UpdateStructure()
+	{
+		structure.GatherBins(structureMerged, nThreads);
+		domains.Sum(structureMerged.data(), int(structureMerged.size()));
+		structure.AddCounts(structureMerged);
+		// In the order they were taken, every rank has the same number of them
+		observables.Join();
+		for (std::shared_ptr<ModeSnapshot>& snapshot : modeSnapshots)
+		{
+			double count = snapshot->count;
+			domains.Sum(&count, 1);
+			domains.Sum(snapshot->rho.data(), int(snapshot->rho.size()));
+			structure.AddModeSample(snapshot->rho.data(), int(count));
+		}
+		modeSnapshots.clear();
+		if (structure.nSamples == 0)
+			return;
+
+		std::vector<real>& r = profiles["r"];
+		std::vector<real>& g = profiles["g(r)"];
+		structure.RadialDistribution(r, g);
+		if (structure.ModesEnabled())
+			structure.StructureFactor(profiles["k"], profiles["S(k)"]);
+		// First shell of neighbours, the height says how ordered the packing is
+		int peak = 0;
+		for (int b = 1; b < int(g.size()); ++b)
+			if (g[b] > g[peak])
+				peak = b;
+		stats.Set(handles.gPeak, g.empty() ? real(0) : g[peak]);
+		stats.Set(handles.gPeakR, r.empty() ? real(0) : r[peak]);
+	}
+	void WriteStructure()
+	{
+		if (domains.Rank() != 0 || structureFilename.empty() || structure.nSamples == 0)
+			return;
+		const std::vector<real>& r = profiles["r"];
+		const std::vector<real>& g = profiles["g(r)"];
+		std::ofstream out(OutputName(structureFilename));
+		out.precision(8);
+		out << "# " << structure.nSamples << " samples" << std::endl;
+		out << "r\tg(r)" << std::endl;
+		for (size_t b = 0; b < r.size(); ++b)
+			out << r[b] << "\t" << g[b] << std::endl;
+		if (!structure.ModesEnabled())
+			return;
+		const std::vector<real>& k = profiles["k"];
+		const std::vector<real>& sk = profiles["S(k)"];
+		out << std::endl << "k\tS(k)" << std::endl;
+		for (size_t b = 0; b < k.size(); ++b)
+			out << k[b] << "\t" << sk[b] << std::endl;
 	}
 	
 	void AccelGPU()
@@ -565,18 +2378,42 @@ private:
 	}
 
 public:
+	// Snapshot work reads structure, which goes before the scheduler would drain it
+	virtual ~VerletSimulator() { observables.Join(); }
+
 	virtual void Initialize(const std::string& configFilename) override
 	{
+		// Snapshot work still running reads the old setup
+		observables.Join();
 		InitializeConfig(configFilename);
 
+		if (domains.Active())
+			domains.ExchangeHalo(comps, globalIds, nActive, nGhost);
+		if (forceKernel == ForceKernelAuto && !bSimulateOnGPU)
+			SelectForceKernel();
 		pe = 0;
-		Accel(Vector2r{ Lx, Ly }, pe);
+		// Accel() expects a team around it, even a replica nested in someone else's region
+#pragma omp parallel num_threads(nThreads)
+		{
+			Accel(Vector2r{ Lx, Ly }, pe, RespaActive() ? ForcesNear : ForcesAll);
+			if (RespaActive())
+				Accel(Vector2r{ Lx, Ly }, pe, ForcesFar);
+		}
 		_time = 0;
+		updateStartTime = 0;
 		pe = 0;
 		ke = 0;
 		xFlux = yFlux = 0;
 		virial = 0;
 		collisionsNum = doubleCollisions = tripleCollisions = 0;
+		forceEvaluations = 0;
+		bHaveInitialEnergy = false;
+		bHaveStepMaxima = false;
+		dtScale = 1;
+		stepsTaken = 0;
+		SetupCorrelator();
+		SetupObservables();
+		SetupStats();
 
 		if (bSimulateOnGPU)
 			AccelGPU();
@@ -585,23 +2422,53 @@ public:
 	{
 		if (bSimulate)
 		{
-			for (int iAvg = 0; iAvg < nAvg; ++iAvg)
+			if (bSimulateOnGPU)
 			{
-				if (bUseAdaptiveTimeStep)
-					AdjustTimeStep();
-				if (bSimulateOnGPU) 
+				for (int iAvg = 0; iAvg < nAvg; ++iAvg)
 				{
+					if (bUseAdaptiveTimeStep)
+						AdjustTimeStep();
 					VerletGPU();
+					_time.Add(dt);
 				}
-				else
+			}
+			else
+			{
+				// One region for the whole batch instead of a fork/join per phase
+#pragma omp parallel num_threads(nThreads)
+				for (int iAvg = 0; iAvg < nAvg; ++iAvg)
 				{
-					Verlet();
-					CountCollisions();
+					if (bUseAdaptiveTimeStep)
+						AdjustTimeStep();
+					if (BlockStepsActive())
+						BlockStep();
+					else if (RespaActive())
+						RespaStep();
+					else
+						Verlet(ForcesAll, true);
+					if (observables.Enabled(obsCorrelator))
+						Correlate();
+					else
+					{
+						// The next AdjustTimeStep() has a barrier before it touches dt
+#pragma omp single nowait
+						EndStep();
+					}
 				}
 			}
-			_time += nAvg * dt;
 			UpdateStats();
+			updateStartTime = _time;
 			ResetStats();
+			if (TargetReached())
+			{
+				cout << targetObservable << " is within " << targetError << " after " << updatesDone << " updates, simulation stopped" << endl;
+				bSimulate = false;
+			}
+			if (domains.Failed())
+			{
+				cout << "Domain exchange failed, simulation stopped" << endl;
+				bSimulate = false;
+			}
 		}
 	}
 	virtual void ResetStats() override
@@ -614,15 +2481,17 @@ public:
 	virtual bool GetSimulate() const override { return bSimulate; }
 	virtual void SetSimulate(bool newSimulate) override { bSimulate = newSimulate; }
 
-	virtual int GetN() const override { return N; }
+	// A decomposed run only has its own particles to show
+	virtual int GetN() const override { return domains.Active() ? nActive : N; }
 	virtual real GetDt() const override { return dt; }
 
-	virtual const std::vector<Component<real>>& GetComponents() const override { return comps; }
-	virtual const std::map<std::string, real>& GetStats() const override { return stats; }
+	virtual const ComponentVector<real>& GetComponents() const override { return comps; }
+	virtual const StatsRegistry<real>& GetStatsRegistry() const override { return stats; }
+	virtual const std::map<std::string, std::vector<real>>& GetProfiles() const override { return profiles; }
 	virtual Vector2<real> GetDims() const override { return { Lx, Ly }; }
 
-	VerletProperties<real> GetAsProperties() 
-	{ return (VerletProperties<real>)*this; }
+	VerletProperties<real, accum> GetAsProperties() 
+	{ return (VerletProperties<real, accum>)*this; }
 
 	virtual void SetGPUSimulation(bool newGPUSim) 
 	{
@@ -630,6 +2499,15 @@ public:
 		InitGPU();
 	}
 	virtual bool GetGPUSimulation() const { return bSimulateOnGPU; }
+	virtual void SetSeed(unsigned int newSeed) override { seedOverride = newSeed; }
+	virtual void SetOutputSuffix(const std::string& newSuffix) override { outputSuffix = newSuffix; }
+	virtual void WriteOutputs() override
+	{
+		if (structure.Enabled())
+			WriteStructure();
+		if (observables.Enabled(obsCorrelator))
+			WriteCorrelations();
+	}
 
 	virtual void Draw() 
 	{